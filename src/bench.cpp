@@ -0,0 +1,534 @@
+/* bench.cpp */
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <random>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <time.h>
+#include <stdio.h>
+#include <cstring>
+
+#define DEFAULT_PARSIM "bin/parsim"
+#define DEFAULT_OUTPUT "bin/bench.json"
+#define SERVICES_COUNT 10
+#define READ_SIZE 65536
+
+// Error definitions
+#define USAGE_ERR "Usage: parsim_bench [--parsim path] [--out file] " \
+  "[--messages n] [--mix id:weight,...] [--delay fixed:ms|uniform:min:max|" \
+  "exp:mean] [--range min:max] [--fanout n] [--rate messages/s] " \
+  "[--queues n,... (0: -c)] [-c n,...] [-b n,...] [--seed n]"
+#define SPAWN_ERR "Could not start parsim"
+#define OUTPUT_ERR "Could not write the results file"
+
+using namespace std;
+
+/* Current CLOCK_MONOTONIC time in nanoseconds */
+static long long monotonicNow() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* What is generated and which parsim configurations are measured */
+struct BenchConfig {
+  string parsim;
+  string output;
+  int messages;
+  double weights[SERVICES_COUNT];
+  string delayKind;
+  double delayA;
+  double delayB;
+  long long rangeMin;
+  long long rangeMax;
+  int fanout;
+  double rate;
+  // A queue size of 0 starts the services without one, so -c applies
+  vector<int> queueSizes;
+  vector<int> defaultSizes;
+  vector<int> backendSizes;
+  unsigned int seed;
+};
+
+/*
+  Outcome of running parsim once. queueSize is what the services got and
+  defaultSize the -c it came from, or -1 when it was given to them
+*/
+struct BenchRun {
+  int queueSize;
+  int defaultSize;
+  int backendSize;
+  long expected;
+  long received;
+  double seconds;
+  double p50;
+  double p99;
+  double p999;
+};
+
+/* Synthetic input: every message and the results it must produce */
+class Workload {
+  private:
+    string text;
+    vector<long> lineEnds;
+    long expected;
+  public:
+    void generate(BenchConfig &);
+    const string & getText();
+    long getLineEnd(int);
+    long getExpected();
+};
+
+void Workload::generate(BenchConfig & config) {
+
+  mt19937_64 random(config.seed);
+  discrete_distribution<int> services(config.weights,
+                                      config.weights + SERVICES_COUNT);
+  uniform_int_distribution<long long> operands(config.rangeMin,
+                                               config.rangeMax);
+  uniform_int_distribution<int> widths(1, config.fanout);
+  uniform_real_distribution<double> uniformDelay(config.delayA,
+                                                 config.delayB);
+  exponential_distribution<double> exponentialDelay(
+    config.delayA > 0 ? 1.0 / config.delayA : 1.0);
+  int active = 0;
+
+  for (int i = 0; i < SERVICES_COUNT; i++) {
+    if (config.weights[i] > 0) active++;
+  }
+
+  expected = 0;
+  char line[256];
+
+  for (int sequence = 0; sequence < config.messages; sequence++) {
+
+    // Distinct services, so every result is identified by sequence:service
+    int width = min(widths(random), active);
+    bool chosen[SERVICES_COUNT] = {false};
+    string servicesText, delaysText;
+
+    for (int i = 0; i < width; i++) {
+      int service;
+      do {
+        service = services(random);
+      } while (chosen[service]);
+      chosen[service] = true;
+
+      long delay = 0;
+      if (config.delayKind == "fixed") {
+        delay = (long) config.delayA;
+      } else if (config.delayKind == "uniform") {
+        delay = (long) uniformDelay(random);
+      } else {
+        delay = config.delayA > 0 ? (long) exponentialDelay(random) : 0;
+      }
+
+      servicesText += (i > 0 ? "," : "") + to_string(service);
+      delaysText += (i > 0 ? "," : "") + to_string(delay);
+    }
+
+    // The second operand is never 0 so DIV and MOD always have a result
+    long long number1 = operands(random);
+    long long number2 = operands(random);
+    if (number2 == 0) number2 = 1;
+
+    int length = snprintf(line, sizeof(line), "%d:%s:%lld:%lld:%s\n",
+                          sequence, servicesText.c_str(), number1, number2,
+                          delaysText.c_str());
+    text.append(line, length);
+    lineEnds.push_back(text.length());
+    expected += width;
+  }
+
+}
+
+const string & Workload::getText() {
+  return text;
+}
+
+long Workload::getLineEnd(int message) {
+  return lineEnds[message];
+}
+
+long Workload::getExpected() {
+  return expected;
+}
+
+/*
+  Feeds a workload to one parsim process and times every result. The time a
+  message is sent is taken when the write containing its last byte returns;
+  its results are timed when the line carrying them is read back.
+*/
+class Runner {
+  private:
+    BenchConfig & config;
+    Workload & workload;
+    vector<long long> sentAt;
+    vector<double> latencies;
+    pid_t start(int, int, int, int &, int &);
+    static double percentile(vector<double> &, double);
+  public:
+    Runner(BenchConfig &, Workload &);
+    bool run(int, int, int, BenchRun &);
+};
+
+Runner::Runner(BenchConfig & config, Workload & workload) :
+  config(config), workload(workload) {
+}
+
+pid_t Runner::start(int queueSize, int defaultSize, int backendSize,
+                    int & input, int & output) {
+
+  int toParsim[2], fromParsim[2];
+  vector<string> arguments;
+
+  arguments.push_back(config.parsim);
+  for (int i = 0; i < SERVICES_COUNT; i++) {
+    if (config.weights[i] > 0) {
+      arguments.push_back("-s");
+      arguments.push_back(to_string(i));
+      if (queueSize > 0) arguments.push_back(to_string(queueSize));
+    }
+  }
+  arguments.push_back("-c");
+  arguments.push_back(to_string(defaultSize));
+  arguments.push_back("-b");
+  arguments.push_back(to_string(backendSize));
+
+  if (pipe(toParsim) < 0 || pipe(fromParsim) < 0) return -1;
+
+  pid_t child = fork();
+
+  if (child == 0) {
+    vector<char *> argv;
+    for (size_t i = 0; i < arguments.size(); i++) {
+      argv.push_back((char *) arguments[i].c_str());
+    }
+    argv.push_back(NULL);
+
+    dup2(toParsim[0], STDIN_FILENO);
+    dup2(fromParsim[1], STDOUT_FILENO);
+    close(toParsim[0]);
+    close(toParsim[1]);
+    close(fromParsim[0]);
+    close(fromParsim[1]);
+    execv(argv[0], &argv[0]);
+    _exit(127);
+  }
+
+  close(toParsim[0]);
+  close(fromParsim[1]);
+  input = toParsim[1];
+  output = fromParsim[0];
+  fcntl(input, F_SETFL, O_NONBLOCK);
+  fcntl(output, F_SETFL, O_NONBLOCK);
+
+  return child;
+
+}
+
+bool Runner::run(int queueSize, int defaultSize, int backendSize,
+                 BenchRun & result) {
+
+  int input, output;
+  pid_t child = start(queueSize, defaultSize, backendSize, input, output);
+
+  if (child < 0) return false;
+
+  const string & text = workload.getText();
+  long written = 0;
+  int message = 0;
+  string pending;
+  char buffer[READ_SIZE];
+
+  sentAt.assign(config.messages, 0);
+  latencies.clear();
+  latencies.reserve(workload.getExpected());
+
+  long long begin = monotonicNow();
+
+  while (output >= 0) {
+
+    pollfd descriptors[2];
+    int count = 0;
+
+    // With a rate, only the messages whose turn has come may be written
+    long allowed = text.length();
+    if (config.rate > 0) {
+      long due = (long) ((monotonicNow() - begin) / 1e9 * config.rate) + 1;
+      allowed = workload.getLineEnd(min(due, (long) config.messages) - 1);
+    }
+
+    descriptors[count].fd = output;
+    descriptors[count++].events = POLLIN;
+    if (input >= 0 && written < allowed) {
+      descriptors[count].fd = input;
+      descriptors[count++].events = POLLOUT;
+    }
+
+    poll(descriptors, count, input >= 0 && written >= allowed ? 1 : -1);
+
+    if (input >= 0 && written < allowed) {
+      ssize_t sent = write(input, text.data() + written, allowed - written);
+      if (sent > 0) {
+        written += sent;
+        long long now = monotonicNow();
+        while (message < config.messages &&
+               workload.getLineEnd(message) <= written) {
+          sentAt[message++] = now;
+        }
+      }
+    }
+
+    // Closing stdin makes parsim finish its work and exit
+    if (input >= 0 && written == (long) text.length()) {
+      close(input);
+      input = -1;
+    }
+
+    ssize_t got = read(output, buffer, sizeof(buffer));
+    if (got == 0) {
+      close(output);
+      output = -1;
+    } else if (got > 0) {
+      long long now = monotonicNow();
+      pending.append(buffer, got);
+
+      size_t lineStart = 0, lineEnd;
+      while ((lineEnd = pending.find('\n', lineStart)) != string::npos) {
+        int sequence = atoi(pending.c_str() + lineStart);
+        if (sequence >= 0 && sequence < config.messages) {
+          latencies.push_back((now - sentAt[sequence]) / 1000.0);
+        }
+        lineStart = lineEnd + 1;
+      }
+      pending.erase(0, lineStart);
+    }
+  }
+
+  long long end = monotonicNow();
+  int status;
+  waitpid(child, &status, 0);
+
+  sort(latencies.begin(), latencies.end());
+
+  result.queueSize = queueSize > 0 ? queueSize : defaultSize;
+  result.defaultSize = queueSize > 0 ? -1 : defaultSize;
+  result.backendSize = backendSize;
+  result.expected = workload.getExpected();
+  result.received = latencies.size();
+  result.seconds = (end - begin) / 1e9;
+  result.p50 = percentile(latencies, 0.50);
+  result.p99 = percentile(latencies, 0.99);
+  result.p999 = percentile(latencies, 0.999);
+
+  return true;
+
+}
+
+double Runner::percentile(vector<double> & sorted, double rank) {
+
+  if (sorted.empty()) return 0;
+  size_t position = (size_t) (rank * (sorted.size() - 1) + 0.5);
+  return sorted[position];
+
+}
+
+/* Splits "1,2,3" into numbers */
+static vector<int> parseSizes(const string & list) {
+
+  vector<int> sizes;
+  size_t start = 0;
+
+  while (start <= list.length()) {
+    size_t comma = list.find(',', start);
+    if (comma == string::npos) comma = list.length();
+    if (comma > start) sizes.push_back(atoi(list.substr(start).c_str()));
+    start = comma + 1;
+  }
+
+  return sizes;
+
+}
+
+static bool parseArguments(int argc, char * argv[], BenchConfig & config) {
+
+  config.parsim = DEFAULT_PARSIM;
+  config.output = DEFAULT_OUTPUT;
+  config.messages = 100000;
+  for (int i = 0; i < SERVICES_COUNT; i++) {
+    config.weights[i] = 1;
+  }
+  config.delayKind = "fixed";
+  config.delayA = 0;
+  config.delayB = 0;
+  config.rangeMin = -1000000;
+  config.rangeMax = 1000000;
+  config.fanout = 3;
+  config.rate = 0;
+  config.queueSizes = parseSizes("0,256");
+  config.defaultSizes = parseSizes("16");
+  config.backendSizes = parseSizes("16,256");
+  config.seed = 1;
+
+  for (int i = 1; i < argc; i++) {
+
+    string option = argv[i];
+    if (i + 1 >= argc) return false;
+    string value = argv[++i];
+
+    if (option == "--parsim") {
+      config.parsim = value;
+    } else if (option == "--out") {
+      config.output = value;
+    } else if (option == "--messages") {
+      config.messages = atoi(value.c_str());
+    } else if (option == "--mix") {
+      // id:weight pairs; services left out are not used
+      for (int j = 0; j < SERVICES_COUNT; j++) config.weights[j] = 0;
+      size_t start = 0;
+      while (start < value.length()) {
+        size_t comma = value.find(',', start);
+        if (comma == string::npos) comma = value.length();
+        string pair = value.substr(start, comma - start);
+        size_t colon = pair.find(':');
+        int service = atoi(pair.c_str());
+        if (service < 0 || service >= SERVICES_COUNT) return false;
+        config.weights[service] = colon == string::npos ? 1 :
+                                  atof(pair.c_str() + colon + 1);
+        start = comma + 1;
+      }
+    } else if (option == "--delay") {
+      size_t colon = value.find(':');
+      config.delayKind = value.substr(0, colon);
+      if (colon == string::npos) return false;
+      config.delayA = atof(value.c_str() + colon + 1);
+      size_t second = value.find(':', colon + 1);
+      config.delayB = second == string::npos ? config.delayA :
+                      atof(value.c_str() + second + 1);
+      if (config.delayKind != "fixed" && config.delayKind != "uniform" &&
+          config.delayKind != "exp") {
+        return false;
+      }
+    } else if (option == "--range") {
+      size_t colon = value.find(':', 1);
+      if (colon == string::npos) return false;
+      config.rangeMin = atoll(value.c_str());
+      config.rangeMax = atoll(value.c_str() + colon + 1);
+    } else if (option == "--fanout") {
+      config.fanout = max(1, atoi(value.c_str()));
+    } else if (option == "--rate") {
+      config.rate = atof(value.c_str());
+    } else if (option == "--queues") {
+      config.queueSizes = parseSizes(value);
+    } else if (option == "-c") {
+      config.defaultSizes = parseSizes(value);
+    } else if (option == "-b") {
+      config.backendSizes = parseSizes(value);
+    } else if (option == "--seed") {
+      config.seed = atoi(value.c_str());
+    } else {
+      return false;
+    }
+  }
+
+  double total = 0;
+  for (int i = 0; i < SERVICES_COUNT; i++) total += config.weights[i];
+
+  return total > 0 && config.messages > 0 && config.rangeMin <= config.rangeMax;
+
+}
+
+static void writeJson(FILE * out, BenchConfig & config,
+                      vector<BenchRun> & runs) {
+
+  fprintf(out, "{\n  \"messages\": %d,\n  \"mix\": [", config.messages);
+  for (int i = 0; i < SERVICES_COUNT; i++) {
+    fprintf(out, "%s%g", i > 0 ? ", " : "", config.weights[i]);
+  }
+  fprintf(out, "],\n  \"delay\": {\"kind\": \"%s\", \"a\": %g, \"b\": %g},\n",
+          config.delayKind.c_str(), config.delayA, config.delayB);
+  fprintf(out, "  \"range\": [%lld, %lld],\n  \"fanout\": %d,\n",
+          config.rangeMin, config.rangeMax, config.fanout);
+  fprintf(out, "  \"rate\": %g,\n  \"seed\": %u,\n  \"runs\": [\n",
+          config.rate, config.seed);
+
+  for (size_t i = 0; i < runs.size(); i++) {
+    BenchRun & run = runs[i];
+    char defaultSize[16] = "null";
+    if (run.defaultSize >= 0) {
+      snprintf(defaultSize, sizeof(defaultSize), "%d", run.defaultSize);
+    }
+    fprintf(out, "    {\"queue\": %d, \"c\": %s, \"b\": %d, "
+            "\"results_expected\": %ld, \"results\": %ld, \"seconds\": %.6f, "
+            "\"messages_per_second\": %.1f, \"latency_us\": {\"p50\": %.1f, "
+            "\"p99\": %.1f, \"p99.9\": %.1f}}%s\n",
+            run.queueSize, defaultSize, run.backendSize, run.expected,
+            run.received, run.seconds, config.messages / run.seconds, run.p50,
+            run.p99, run.p999, i + 1 < runs.size() ? "," : "");
+  }
+
+  fprintf(out, "  ]\n}\n");
+
+}
+
+int main(int argc, char * argv[]) {
+
+  BenchConfig config;
+
+  if (!parseArguments(argc, argv, config)) {
+    cerr << USAGE_ERR << endl;
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  Workload workload;
+  workload.generate(config);
+
+  Runner runner(config, workload);
+  vector<BenchRun> runs;
+
+  for (size_t q = 0; q < config.queueSizes.size(); q++) {
+    // -c only matters to the services started without a size
+    size_t defaults = config.queueSizes[q] > 0 ? 1 :
+                      config.defaultSizes.size();
+
+    for (size_t c = 0; c < defaults; c++) {
+      for (size_t b = 0; b < config.backendSizes.size(); b++) {
+
+        BenchRun run;
+        if (!runner.run(config.queueSizes[q], config.defaultSizes[c],
+                        config.backendSizes[b], run)) {
+          cerr << SPAWN_ERR << endl;
+          return 1;
+        }
+
+        fprintf(stderr, "queue %d%s -b %d: %.0f messages/s, "
+                "p50 %.1fus p99 %.1fus p99.9 %.1fus (%ld/%ld results)\n",
+                run.queueSize, run.defaultSize >= 0 ? " (-c)" : "",
+                run.backendSize,
+                config.messages / run.seconds, run.p50, run.p99, run.p999,
+                run.received, run.expected);
+        runs.push_back(run);
+      }
+    }
+  }
+
+  FILE * out = fopen(config.output.c_str(), "w");
+  if (out == NULL) {
+    cerr << OUTPUT_ERR << endl;
+    return 1;
+  }
+  writeJson(out, config, runs);
+  fclose(out);
+
+  return 0;
+
+}
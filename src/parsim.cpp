@@ -1,25 +1,112 @@
 /* parsim.cpp */
 #include <iostream>
 #include <algorithm>
-#include <sstream>
 #include <string>
 #include <vector>
 #include <sched.h>
 #include <unistd.h>
-#include <semaphore.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <signal.h>
 #include <stdio.h>
 #include <cstring>
+#include <atomic>
+#include <climits>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <sys/prctl.h>
+#include <immintrin.h>
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <new>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <linux/io_uring.h>
+#include "parsim_shm.h"
 
 #define S "-s"
 #define C "-c"
 #define B "-b"
+#define W "-w"
+#define F "-f"
+#define FLUSH "-F"
+#define METRICS "-m"
+#define METRICS_FILE "-M"
+#define AGGREGATE "-A"
+#define ORDERED "--ordered"
+#define PIN "-p"
+#define THREAD_STACK "-t"
+#define QUEUE_POLICY "-q"
+#define LANES "-L"
+#define BINARY "--binary"
+#define OUTPUT_FORMAT "-O"
+#define OUTPUT_FILE "-o"
+#define LISTEN_UNIX "-U"
+#define LISTEN_TCP "-T"
+#define RESULT_CACHE "-R"
+#define HUGE_PAGES "-H"
+#define ELASTIC "-e"
+#define IO_URING "--io-uring"
+#define SHARED "-S"
 #define COMMA ','
 #define TWO_POINTS ':'
-#define WHITE_SPACE ' '
+#define NEXT_STAGE '>'
+#define MESSAGE_FIELDS 5
+#define PRIORITY_FIELD 5
+#define PRIORITIES 3
+#define PRIORITY_STREAK 8
+#define DELAY_LIMIT (1 << 30)
+#define MAX_MESSAGE_SERVICES 16
+#define MAX_PIPELINE_STAGES 4
+#define PIPELINES 4096
 #define STACK_SIZE 16384
+#define ARENA_BLOCK_SIZE (64UL * 1024 * 1024)
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define CACHE_LINE_SIZE 64
+#define SPIN_TRIES 64
+#define STEAL_INTERVAL_MS 10
+#define SCALE_INTERVAL_MS 100
+#define SCALE_CALM_INTERVALS 10
+#define FILE_CHUNK_SIZE (256 * 1024)
+#define MAX_FILE_PARSERS 8
+#define OUTPUT_BUFFER_SIZE 65536
+#define OUTPUT_BUFFERS 4
+#define MAX_FLUSH_SIZE (64 * 1024 * 1024)
+#define MAX_RESULT_LENGTH (32 + MAX_MESSAGE_SERVICES * 26)
+#define BATCH_SIZE 64
+#define MIN_AGGREGATION_SLOTS 1024
+#define ORDER_WINDOW 4096
+#define SPILL_SIZE 65536
+#define BINARY_MAGIC "PSIM"
+#define BINARY_VERSION 1
+#define BINARY_SERVICES 10
+#define BINARY_BUFFER_SIZE (1024 * 1024)
+#define INPUT_BLOCK_SIZE (256 * 1024)
+#define RESULT_MAGIC "PSIR"
+#define RESULT_VERSION 1
+#define COLUMN_BLOCK_SIZE 2048
+#define MISSING_SERVICE 255
+#define RESULT_ERROR '!'
+#define RESULT_MISSING '?'
+#define MAX_CONNECTIONS 256
+#define SHARED_RING_SIZE 4096
+#define SHARED_POLL_MS 100
+#define CONNECTION_BUFFER_SIZE 65536
+#define SEND_TIMEOUT_MS 1000
+#define MAX_EVENTS 64
+#define CACHE_WAYS 4
 
 // Error definitions
 #define SYNTAX_ERROR "Syntax Error. Try again"
@@ -28,9 +115,80 @@
 #define ZERO_SERVICES_ACTIVE_ERR "At least one service must be started"
 #define SET_DEFAULT_SIZE_ERR "You must send a default queue size"
 #define SET_BACKEND_QUEUE_ERR "You may pass backend queue size"
-#define UNRECOGNIZED_OPERATION_ERR "Unrecognized operation"
 #define DEFAULT_QUEUE_SIZE_ERR "Send a correct default queue size"
 #define CONVERSION_EXCEPTION "Error. There is a number too big to cast"
+#define WORKERS_ERR "Send a correct number of workers after a service"
+#define ELASTIC_ERR "Send after a service the largest queue size and " \
+  "number of workers it may scale to, no smaller than its own"
+#define INPUT_FILE_ERR "Could not read the input file"
+#define DIVISION_BY_ZERO_ERR "Division by zero"
+#define REJECTED_ERR "Rejected, queue full"
+#define DROPPED_ERR "Dropped, queue full"
+#define BINARY_HEADER_ERR "Binary input needs a version 1 parsim header"
+#define BINARY_TRUNCATED_ERR "Binary input ends in the middle of a message"
+#define OUTPUT_FORMAT_ERR "Output format must be text, binary or columns"
+#define OUTPUT_FILE_ERR "Could not open the output file"
+#define CACHE_SIZE_ERR "Send a correct number of entries for the result cache"
+#define LANE_SIZE_ERR "Send a correct size for the dispatch lanes"
+#define QUEUE_POLICY_ERR "Send block, reject, drop-oldest or spill after a " \
+  "service"
+#define METRICS_ERR "Send a metrics interval in milliseconds and a " \
+  "writable file"
+#define FLUSH_POLICY_ERR "Flush policy must be immediate, size:<bytes> " \
+  "(up to 64 MiB) or time:<ms>"
+#define AGGREGATE_ERR "Send the aggregation timeout in milliseconds"
+#define AFFINITY_ERR "Send a list of allowed cpus after a service or -b"
+#define STACK_SIZE_ERR "Send a thread stack size of at least 16 KiB"
+#define THREAD_ERR "Could not create a thread"
+#define ARENA_ERR "Could not reserve memory for the queues"
+#define ORDER_WINDOW_ERR "Send a correct size for the order window"
+#define LISTEN_ERR "Send a socket path after -U and a port after -T"
+#define LISTEN_SOCKET_ERR "Could not listen on the socket"
+#define CONNECTIONS_ERR "Too many connections"
+#define CONNECTION_COLUMNS_ERR "Columns can't be written to connections"
+#define SHARED_ERR "Send a shared memory name after -S, and a ring size " \
+  "of at least 2"
+#define SHARED_MEMORY_ERR "Could not create the shared memory rings"
+#define SHARED_INPUT_ERR "-S can't be used with -f, --binary, -U, -T, -O or -o"
+
+// Parser results
+#define PARSE_OK 0
+#define PARSE_SYNTAX_ERROR 1
+#define PARSE_MESSAGE_ERROR 2
+#define PARSE_CONVERSION_ERROR 3
+#define PARSE_END 4
+#define PARSE_EMPTY 5
+
+// Status of a result
+#define ITEM_OK 0
+#define ITEM_DIVISION_BY_ZERO 1
+#define ITEM_MISSING 2
+#define ITEM_REJECTED 3
+#define ITEM_DROPPED 4
+
+// Items the FrontEnd sends the BackEnd about a connection instead of results
+#define ITEM_OPEN 5
+#define ITEM_CLOSE 6
+
+// Whether the slot of a connection can take a new client
+#define CONNECTION_FREE 0
+#define CONNECTION_OPEN 1
+
+// What the FrontEnd does when a service queue is full
+#define OVERFLOW_BLOCK 0
+#define OVERFLOW_REJECT 1
+#define OVERFLOW_DROP 2
+#define OVERFLOW_SPILL 3
+
+// How results are written
+#define OUTPUT_TEXT 0
+#define OUTPUT_BINARY 1
+#define OUTPUT_COLUMNS 2
+
+// Flush policies of the results
+#define FLUSH_IMMEDIATE 0
+#define FLUSH_SIZE 1
+#define FLUSH_TIME 2
 
 //Service definitions
 #define SUM 0
@@ -43,53 +201,195 @@
 #define XOR 7
 #define NAND 8
 #define NOR 9
+#define POW 10
+#define GCD 11
+#define SERVICES_COUNT 12
 
 using namespace std;
 
 vector<pid_t> threads;
 
-struct BufferInMiddleEnd {
-  int sequence;
-  long long number1;
-  long long number2;
-  unsigned int delay;
-};
+// Bytes of stack of every cloned thread, set with -t
+size_t threadStackSize = STACK_SIZE;
 
-struct BufferInBackEnd {
-  int sequence;
-  short service;
-  long long result;
+/* What a cloned thread runs and the cpus it may run on */
+struct ThreadStart {
+  int (*function)(void *);
+  void * arg;
+  bool pinned;
+  cpu_set_t cpus;
 };
 
-class BackEnd {
+/*
+  Entry point of every cloned thread. Threads are processes of their own, so
+  they must die with parsim when it exits early because of an error
+*/
+static int threadEntry(void * arg) {
+
+  ThreadStart * start = (ThreadStart*) arg;
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+  if (start->pinned) {
+    sched_setaffinity(0, sizeof(start->cpus), &start->cpus);
+  }
+
+  return start->function(start->arg);
+
+}
+
+/* NUMA node of a cpu as listed in sysfs, -1 when it is not known */
+static int cpuNode(int cpu) {
+
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+  DIR * directory = opendir(path);
+  if (directory == NULL) return -1;
+
+  int node = -1;
+  dirent * entry;
+  while (node < 0 && (entry = readdir(directory)) != NULL) {
+    if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4])) {
+      node = atoi(entry->d_name + 4);
+    }
+  }
+  closedir(directory);
+
+  return node;
+
+}
+
+/*
+  Memory of the queues, delay heaps, output buffers and thread stacks. It is
+  reserved in large blocks that only take memory once touched, and handed
+  out by bumping a pointer, so it never goes back and storage that is used
+  together sits on few pages. With -H the blocks are aligned to and backed
+  by 2 MiB transparent huge pages, so the queues take far fewer TLB
+  entries. Only main allocates, before the threads using the memory start
+*/
+class Arena {
   private:
-    BufferInBackEnd * itemsBackEnd;
-    int bufferSize;
-    int in;
-    int out;
-    sem_t full, empty, mutex;
+    char * block;
+    size_t used;
+    size_t size;
+    bool hugePages;
+    void grow(size_t);
   public:
-    static int consume (void *);
-    void produce(BufferInBackEnd);
-    void start (int);
+    Arena();
+    void useHugePages();
+    void * allocate(size_t, size_t = CACHE_LINE_SIZE);
 };
 
-void BackEnd::start(int bufferSize) {
+Arena::Arena() {
+  block = NULL;
+  used = 0;
+  size = 0;
+  hugePages = false;
+}
+
+/* Blocks taken from now on, and the current one, use huge pages */
+void Arena::useHugePages() {
 
-  this->bufferSize = bufferSize;
-  itemsBackEnd = new BufferInBackEnd[bufferSize];
+  hugePages = true;
+  if (block != NULL) madvise(block, size, MADV_HUGEPAGE);
 
-  in = 0;
-  out = 0;
+}
 
-  sem_init(&mutex, 0, 1);
-  sem_init(&full, 0, 0);
-  sem_init(&empty, 0, bufferSize);
+/* Starts a new block with room for at least minimum bytes */
+void Arena::grow(size_t minimum) {
 
-  //Assign the stack that will be used by the service's thread
-  //STACK_SIZE = 16384 => 2^14
-  void ** stack = (void **) malloc(STACK_SIZE) + STACK_SIZE / sizeof(*stack);
-    /*
+  size_t length = max((size_t) ARENA_BLOCK_SIZE,
+                      (minimum + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+                      HUGE_PAGE_SIZE);
+
+  // One huge page more, to cut an aligned block out of the mapping
+  char * mapping = (char *) mmap(NULL, length + HUGE_PAGE_SIZE,
+                                 PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                                 MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapping == MAP_FAILED) {
+    cerr << ARENA_ERR << endl;
+    exit(0);
+  }
+
+  char * aligned = (char *) (((uintptr_t) mapping + HUGE_PAGE_SIZE - 1) &
+                             ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+  if (aligned > mapping) munmap(mapping, aligned - mapping);
+  munmap(aligned + length, mapping + HUGE_PAGE_SIZE - aligned);
+
+  if (hugePages) madvise(aligned, length, MADV_HUGEPAGE);
+
+  block = aligned;
+  size = length;
+  used = 0;
+
+}
+
+/* bytes aligned to alignment, a power of two no larger than a page */
+void * Arena::allocate(size_t bytes, size_t alignment) {
+
+  size_t start = (used + alignment - 1) & ~(alignment - 1);
+
+  if (block == NULL || start + bytes > size) {
+    grow(bytes);
+    start = 0;
+  }
+
+  used = start + bytes;
+  return block + start;
+
+}
+
+Arena arena;
+
+/*
+  Takes a stack of threadStackSize bytes from the arena with a guard page
+  below it, so an overflow faults instead of overwriting other memory. The
+  pages of a pinned thread are preferably taken from the NUMA node of its
+  first cpu; they are only allocated when the thread touches them, already
+  on that node
+*/
+static void * allocateStack(const cpu_set_t * cpus) {
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (threadStackSize + page - 1) / page * page;
+
+  char * base = (char *) arena.allocate(size + page, page);
+  mprotect(base, page, PROT_NONE);
+
+  int node = -1;
+  for (int cpu = 0; cpus != NULL && node < 0 && cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, cpus)) node = cpuNode(cpu);
+  }
+
+  if (node >= 0 && node < (int) (8 * sizeof(unsigned long))) {
+    unsigned long nodes = 1UL << node;
+    syscall(SYS_mbind, base + page, size, MPOL_PREFERRED, &nodes,
+            8 * sizeof(nodes), 0);
+  }
+
+  // Stacks grow down, the thread starts at the top
+  return base + page + size;
+
+}
+
+/*
+  Clones a thread that shares memory and file descriptors with the caller
+  and registers it so main can wait for it. A thread given cpus only runs on
+  those. Threads start with SIGINT and SIGTERM blocked and keep them so:
+  when the whole process group gets one, like with Ctrl-C, only main acts on
+  it, and the threads live on to finish and write what they hold
+*/
+pid_t spawnThread(int (*function)(void *), void * arg,
+                  const cpu_set_t * cpus = NULL) {
+
+  //Assign the stack that will be used by the thread
+  void * stack = allocateStack(cpus);
+  ThreadStart * start = new (arena.allocate(sizeof(ThreadStart))) ThreadStart;
+  start->function = function;
+  start->arg = arg;
+  start->pinned = cpus != NULL;
+  if (cpus != NULL) start->cpus = *cpus;
+  /*
   CLONE FLAGS:
   - CLONE_VM: Clones the virtual machine. The calling process and the child
               process run in the same memory space
@@ -99,714 +399,5731 @@ void BackEnd::start(int bufferSize) {
              process of the thread group is sent a SIGCHLD (or other termina‐
              tion) signal.
   */
-  pid_t thread = ::clone(BackEnd::consume, stack, CLONE_VM | CLONE_FILES |
-                         SIGCHLD, this);
-
+  sigset_t stopping;
+  sigset_t previous;
+  sigemptyset(&stopping);
+  sigaddset(&stopping, SIGINT);
+  sigaddset(&stopping, SIGTERM);
+  sigprocmask(SIG_BLOCK, &stopping, &previous);
+
+  pid_t thread = ::clone(threadEntry, stack, CLONE_VM | CLONE_FILES | SIGCHLD,
+                         start);
+  sigprocmask(SIG_SETMASK, &previous, NULL);
+  if (thread < 0) {
+    cerr << THREAD_ERR << endl;
+    exit(0);
+  }
   threads.push_back(thread);
 
+  return thread;
+
 }
 
-void BackEnd::produce(BufferInBackEnd item) {
+/* Waits for a thread that finishes before the program does */
+void joinThread(pid_t thread) {
 
-  sem_wait(&empty);
-  sem_wait(&mutex);
-  itemsBackEnd[in] = item;
-  in = (in + 1) % bufferSize;
-  sem_post(&mutex);
-  sem_post(&full);
+  int status;
+  waitpid(thread, &status, 0);
+  threads.erase(find(threads.begin(), threads.end(), thread));
 
 }
 
-int BackEnd::consume (void * arg) {
-
-  //Get the reference of the BackEnd
-  BackEnd * backEnd = (BackEnd*) arg;
-
-  while(true){
-    sem_wait(&backEnd->full);
-    sem_wait(&backEnd->mutex);
-    int sequence = backEnd->itemsBackEnd[backEnd->out].sequence;
-    int result = backEnd->itemsBackEnd[backEnd->out].result;
-    short service = backEnd->itemsBackEnd[backEnd->out].service;
+/* Current CLOCK_MONOTONIC time in nanoseconds */
+static long long monotonicNow() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
-    //Print result to the user
-    cout << sequence << ":" << service << ":" << result << endl;
+static timespec toTimespec(long long nanoseconds) {
+  timespec time;
+  time.tv_sec = nanoseconds / 1000000000LL;
+  time.tv_nsec = nanoseconds % 1000000000LL;
+  return time;
+}
 
-    backEnd->out = (backEnd->out + 1) % backEnd->bufferSize;
-    sem_post(&backEnd->mutex);
-    sem_post(&backEnd->empty);
-  }
+/*
+  Sleeps while the futex word still holds the expected value. The deadline is
+  an absolute CLOCK_MONOTONIC time in nanoseconds, or 0 to wait forever
+*/
+static void futexWait(atomic<int> * word, int expected,
+                      long long deadline = 0) {
+  timespec timeout = toTimespec(deadline);
+  syscall(SYS_futex, (int *) word, FUTEX_WAIT_BITSET, expected,
+          deadline > 0 ? &timeout : NULL, NULL, FUTEX_BITSET_MATCH_ANY);
+}
 
+static void futexWake(atomic<int> * word, int count) {
+  syscall(SYS_futex, (int *) word, FUTEX_WAKE, count, NULL, NULL, 0);
 }
 
-class Service {
+/* Counters of a queue since it started. Times are in nanoseconds */
+struct QueueStats {
+  unsigned long enqueued;
+  unsigned long dequeued;
+  unsigned long depth;
+  unsigned long highWater;
+  long long producerBlocked;
+  long long consumerBlocked;
+};
+
+/*
+  Bounded lock-free ring shared by the Services and the BackEnd.
+
+  Each cell carries a sequence number that tells whether it is ready to be
+  written (sequence == position) or to be read (sequence == position + 1), so
+  producers and consumers never take a lock. When a side has a single thread
+  (MultiProducer / MultiConsumer false) its index is advanced with a plain
+  store instead of a compare and swap.
+
+  The ring keeps one spare cell, because with a single cell a published item
+  and a free slot would carry the same sequence number; the capacity asked by
+  the user is enforced against the distance between tail and head instead.
+  That also lets the capacity change at any time, between the one given at
+  first and the largest the cells were made for. Items beyond a capacity
+  that shrank stay queued; producers just wait until they are consumed.
+
+  Head, tail and the two futex words used to sleep when the ring is empty or
+  full live on their own cache lines, so the producer and the consumer don't
+  invalidate each other on every operation. Statistics sit next to the side
+  that updates them; tail and head double as enqueued and dequeued counts.
+*/
+template <typename T, bool MultiProducer, bool MultiConsumer>
+class RingQueue {
   private:
-    BufferInMiddleEnd * itemsMiddleEnd;
-    BackEnd * backEnd;
-    bool status;
-    int type;
-    int bufferSize;
-    int in;
-    int out;
-    sem_t full, empty, mutex;
+    struct Cell {
+      atomic<unsigned long> sequence;
+      T data;
+    };
+    alignas(CACHE_LINE_SIZE) atomic<unsigned long> tail;
+    atomic<unsigned long> highWater;
+    atomic<long long> producerBlocked;
+    alignas(CACHE_LINE_SIZE) atomic<unsigned long> head;
+    atomic<long long> consumerBlocked;
+    alignas(CACHE_LINE_SIZE) atomic<int> pushes;
+    atomic<int> emptyWaiters;
+    atomic<bool> closed;
+    alignas(CACHE_LINE_SIZE) atomic<int> pops;
+    atomic<int> fullWaiters;
+    alignas(CACHE_LINE_SIZE) Cell * cells;
+    unsigned long cellsCount;
+    atomic<unsigned long> capacity;
   public:
-    Service();
-    ~Service();
-    bool getStatus();
-    void start(int, int, BackEnd *);
-    void produce(BufferInMiddleEnd);
-    static int consume (void *);
-    long long calculate(int, long long, long long);
-    void produceBackEnd();
+    void init(unsigned long, unsigned long = 0);
+    void resize(unsigned long);
+    unsigned long getCapacity();
+    bool tryPush(const T &);
+    bool tryPop(T &);
+    void push(const T &);
+    bool pop(T &);
+    bool popUntil(T &, long long);
+    void close();
+    bool drained();
+    unsigned long size();
+    QueueStats stats();
 };
 
-Service::Service() {
-  status = false;
-}
+template <typename T, bool MultiProducer, bool MultiConsumer>
+void RingQueue<T, MultiProducer, MultiConsumer>::init(unsigned long capacity,
+                                                     unsigned long largest) {
 
-Service::~Service() {
-    status = false;
-    sem_destroy(&mutex);
-    sem_destroy(&empty);
-    sem_destroy(&full);
-}
+  this->capacity.store(capacity, memory_order_relaxed);
+  cellsCount = max(capacity, largest) + 1;
+  cells = (Cell *) arena.allocate(cellsCount * sizeof(Cell));
+
+  for (unsigned long i = 0; i < cellsCount; i++) {
+    new (&cells[i]) Cell;
+    cells[i].sequence.store(i, memory_order_relaxed);
+  }
+
+  tail.store(0, memory_order_relaxed);
+  head.store(0, memory_order_relaxed);
+  highWater.store(0, memory_order_relaxed);
+  producerBlocked.store(0, memory_order_relaxed);
+  consumerBlocked.store(0, memory_order_relaxed);
+  pushes.store(0, memory_order_relaxed);
+  pops.store(0, memory_order_relaxed);
+  emptyWaiters.store(0, memory_order_relaxed);
+  fullWaiters.store(0, memory_order_relaxed);
+  closed.store(false, memory_order_relaxed);
 
-bool Service::getStatus() {
-  return status;
 }
 
-void Service::start(int type, int bufferSize, BackEnd * backEnd){
+template <typename T, bool MultiProducer, bool MultiConsumer>
+bool RingQueue<T, MultiProducer, MultiConsumer>::tryPush(const T & item) {
 
-  this->type = type;
-  this->bufferSize = bufferSize;
-  this->backEnd = backEnd;
+  unsigned long position = tail.load(memory_order_relaxed);
+  Cell * cell;
+  long used;
 
-  itemsMiddleEnd = new BufferInMiddleEnd[bufferSize];
-  status = true;
-  in = 0;
-  out = 0;
+  while (true) {
+    // A stale position may lag behind head, hence the signed distance
+    used = (long) (position - head.load(memory_order_acquire));
+    if (used >= (long) capacity.load(memory_order_relaxed)) {
+      return false;
+    }
 
-  sem_init(&mutex, 0, 1);
-  sem_init(&full, 0, 0);
-  sem_init(&empty, 0, bufferSize);
+    cell = &cells[position % cellsCount];
+    unsigned long sequence = cell->sequence.load(memory_order_acquire);
+    long diff = (long) sequence - (long) position;
 
-}
+    if (diff == 0) {
+      if (!MultiProducer) {
+        tail.store(position + 1, memory_order_relaxed);
+        break;
+      }
+      if (tail.compare_exchange_weak(position, position + 1,
+                                     memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // The consumer has not released this cell yet: the ring is full
+      return false;
+    } else {
+      position = tail.load(memory_order_relaxed);
+    }
+  }
 
-void Service::produce(BufferInMiddleEnd item) {
+  cell->data = item;
+  cell->sequence.store(position + 1, memory_order_release);
 
-  sem_wait(&empty);
-  sem_wait(&mutex);
-  itemsMiddleEnd[in] = item;
-  in = (in + 1) % bufferSize;
-  sem_post(&mutex);
-  sem_post(&full);
+  unsigned long depth = used + 1;
+  unsigned long highest = highWater.load(memory_order_relaxed);
+  while (depth > highest &&
+         !highWater.compare_exchange_weak(highest, depth,
+                                          memory_order_relaxed)) {
+  }
+
+  pushes.fetch_add(1);
+  if (emptyWaiters.load() > 0) {
+    futexWake(&pushes, 1);
+  }
+
+  return true;
 
 }
 
-int Service::consume (void * arg) {
+template <typename T, bool MultiProducer, bool MultiConsumer>
+bool RingQueue<T, MultiProducer, MultiConsumer>::tryPop(T & item) {
 
-  //Get the reference of the service
-  Service * service = (Service*) arg;
+  unsigned long position = head.load(memory_order_relaxed);
+  Cell * cell;
 
-  while(service->status){
-    sem_wait(&service->full);
-    sem_wait(&service->mutex);
-    int delay = service->itemsMiddleEnd[service->out].delay;
+  while (true) {
+    cell = &cells[position % cellsCount];
+    unsigned long sequence = cell->sequence.load(memory_order_acquire);
+    long diff = (long) sequence - (long) (position + 1);
 
-    /*
-    Wait the amount of time sent by the user and then produce the result
-    in the backend queue
-    */
-    usleep(delay*1000);
-    service->produceBackEnd();
+    if (diff == 0) {
+      if (!MultiConsumer) {
+        head.store(position + 1, memory_order_relaxed);
+        break;
+      }
+      if (head.compare_exchange_weak(position, position + 1,
+                                     memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Nothing has been published in this cell yet: the ring is empty
+      return false;
+    } else {
+      position = head.load(memory_order_relaxed);
+    }
+  }
+
+  item = cell->data;
+  cell->sequence.store(position + cellsCount, memory_order_release);
 
-    service->out = (service->out + 1) % service->bufferSize;
-    sem_post(&service->mutex);
-    sem_post(&service->empty);
+  pops.fetch_add(1);
+  if (fullWaiters.load() > 0) {
+    futexWake(&pops, 1);
   }
 
+  return true;
+
 }
 
-long long Service::calculate (int type, long long number1, long long number2) {
+template <typename T, bool MultiProducer, bool MultiConsumer>
+void RingQueue<T, MultiProducer, MultiConsumer>::push(const T & item) {
 
-  long long result;
+  for (int i = 0; i < SPIN_TRIES; i++) {
+    if (tryPush(item)) return;
+  }
 
-  switch(type){
-    case SUM:
-      result = number1 + number2;
-      break;
-    case SUB:
-      result = number1 - number2;
-      break;
-    case MULT:
-      result = number1 * number2;
-      break;
-    case DIV:
-      result = number1 / number2;
-      break;
-    case MOD:
-      result = number1 % number2;
-      break;
-    case AND:
-      result = number1 & number2;
-      break;
-    case OR:
-      result = number1 | number2;
-      break;
-    case XOR:
-      result = number1 ^ number2;
-      break;
-    case NAND:
-      result = ~(number1 & number2);
-      break;
-    case NOR:
-      result = ~(number1 | number2);
-      break;
-    default:
-      cout << UNRECOGNIZED_OPERATION_ERR << endl;
-      break;
+  /*
+    Register as a waiter before reading the futex word, so a consumer that
+    frees a cell after our last try is guaranteed to either see us or change
+    the word we are going to sleep on
+  */
+  long long blockedSince = monotonicNow();
+
+  fullWaiters.fetch_add(1);
+  while (true) {
+    int observed = pops.load();
+    if (tryPush(item)) break;
+    futexWait(&pops, observed);
   }
+  fullWaiters.fetch_sub(1);
 
-  return result;
+  producerBlocked.fetch_add(monotonicNow() - blockedSince,
+                            memory_order_relaxed);
 
 }
 
-void Service::produceBackEnd() {
-
-  //Calculate and produce the result in the BackEnd
-  long long number1 = itemsMiddleEnd[out].number1;
-  long long number2 = itemsMiddleEnd[out].number2;
-  BufferInBackEnd item;
-  item.sequence = itemsMiddleEnd[out].sequence;
-  item.service = type;
-  item.result = calculate(type, number1, number2);
-  backEnd->produce(item);
+/* Waits for an item. Only returns false once the ring is closed and empty */
+template <typename T, bool MultiProducer, bool MultiConsumer>
+bool RingQueue<T, MultiProducer, MultiConsumer>::pop(T & item) {
 
-}
+  for (int i = 0; i < SPIN_TRIES; i++) {
+    if (tryPop(item)) return true;
+  }
 
-class MiddleEnd{
-  private:
-    Service sumService;
-    Service subService;
-    Service multService;
-    Service divService;
-    Service modService;
-    Service andService;
-    Service orService;
-    Service xorService;
-    Service nandService;
-    Service norService;
-  public:
-    Service * getService (int);
-    void startService (int, int, BackEnd *);
-};
+  bool popped = true;
+  long long blockedSince = monotonicNow();
 
-Service * MiddleEnd::getService(int service) {
-  switch (service) {
-    case SUM :
-      return &sumService;
-      break;
-    case SUB :
-      return &subService;
-      break;
-    case MULT:
-      return &multService;
-      break;
-    case DIV :
-      return &divService;
-      break;
-    case MOD :
-      return &modService;
-      break;
-    case AND :
-      return &andService;
-      break;
-    case OR:
-      return &orService;
-      break;
-    case XOR:
-      return &xorService;
-      break;
-    case NAND:
-      return &nandService;
-      break;
-    case NOR:
-      return &norService;
+  emptyWaiters.fetch_add(1);
+  while (true) {
+    int observed = pushes.load();
+    if (tryPop(item)) break;
+    if (drained()) {
+      popped = false;
       break;
+    }
+    futexWait(&pushes, observed);
   }
+  emptyWaiters.fetch_sub(1);
+
+  consumerBlocked.fetch_add(monotonicNow() - blockedSince,
+                            memory_order_relaxed);
+
+  return popped;
+
 }
 
-void MiddleEnd::startService (int type, int bufferSize, BackEnd * backEnd) {
+/* Same as pop but gives up at the deadline. Returns whether an item came */
+template <typename T, bool MultiProducer, bool MultiConsumer>
+bool RingQueue<T, MultiProducer, MultiConsumer>::popUntil(T & item,
+                                                         long long deadline) {
 
-  Service * service;
-  //Assign the stack that will be used by the service's thread
-  //STACK_SIZE = 16384 => 2^14
-  void ** stack = (void **) malloc(STACK_SIZE) + STACK_SIZE / sizeof(*stack);
-  pid_t thread;
-
-  switch(type){
-    case SUM:
-      service = &sumService;
-      break;
-    case SUB:
-      service = &subService;
-      break;
-    case MULT:
-      service = &multService;
-      break;
-    case DIV:
-      service = &divService;
-      break;
-    case AND:
-      service = &andService;
-      break;
-    case OR:
-      service = &orService;
-      break;
-    case MOD:
-      service = &modService;
-      break;
-    case NAND:
-      service = &nandService;
-      break;
-    case XOR:
-      service = &xorService;
-      break;
-    case NOR:
-     service = &norService;
-      break;
-    default:
+  bool popped = false;
+  long long blockedSince = monotonicNow();
+
+  emptyWaiters.fetch_add(1);
+  while (true) {
+    int observed = pushes.load();
+    if (tryPop(item)) {
+      popped = true;
       break;
+    }
+    if (drained() || monotonicNow() >= deadline) break;
+    futexWait(&pushes, observed, deadline);
   }
+  emptyWaiters.fetch_sub(1);
 
-  //Going to create a thread consumer for an specific service
-  service->start(type, bufferSize, backEnd);
-  /*
-  CLONE FLAGS:
-  - CLONE_VM: Clones the virtual machine. The calling process and the child
-              process run in the same memory space
-    CLONE_FILES: The calling process and the child share the same file
-                 file descriptor.
-    SIGCHLD: After  all of the threads in a thread group terminate the parent
-             process of the thread group is sent a SIGCHLD (or other termina‐
-             tion) signal.
-  */
-  thread = clone(&Service::consume, stack, CLONE_VM | CLONE_FILES | SIGCHLD,
-                 service);
-  threads.push_back(thread);
+  consumerBlocked.fetch_add(monotonicNow() - blockedSince,
+                            memory_order_relaxed);
+
+  return popped;
 
 }
 
-class FrontEnd{
+/*
+  Tells the consumers no more items will come. Whatever is queued can still
+  be popped; sleeping consumers are woken up to notice
+*/
+template <typename T, bool MultiProducer, bool MultiConsumer>
+void RingQueue<T, MultiProducer, MultiConsumer>::close() {
+  closed.store(true);
+  pushes.fetch_add(1);
+  futexWake(&pushes, INT_MAX);
+}
+
+/*
+  Sets how many items the ring holds, up to the largest given to init.
+  Producers waiting for room are woken up to look again
+*/
+template <typename T, bool MultiProducer, bool MultiConsumer>
+void RingQueue<T, MultiProducer, MultiConsumer>::resize(
+  unsigned long capacity) {
+
+  this->capacity.store(min(capacity, cellsCount - 1));
+  pops.fetch_add(1);
+  futexWake(&pops, INT_MAX);
+
+}
+
+template <typename T, bool MultiProducer, bool MultiConsumer>
+unsigned long RingQueue<T, MultiProducer, MultiConsumer>::getCapacity() {
+  return capacity.load(memory_order_relaxed);
+}
+
+template <typename T, bool MultiProducer, bool MultiConsumer>
+bool RingQueue<T, MultiProducer, MultiConsumer>::drained() {
+  return closed.load() && size() == 0;
+}
+
+template <typename T, bool MultiProducer, bool MultiConsumer>
+unsigned long RingQueue<T, MultiProducer, MultiConsumer>::size() {
+
+  unsigned long first = head.load(memory_order_relaxed);
+  unsigned long last = tail.load(memory_order_relaxed);
+  return last > first ? last - first : 0;
+
+}
+
+template <typename T, bool MultiProducer, bool MultiConsumer>
+QueueStats RingQueue<T, MultiProducer, MultiConsumer>::stats() {
+
+  QueueStats stats;
+  stats.dequeued = head.load(memory_order_relaxed);
+  stats.enqueued = tail.load(memory_order_relaxed);
+  stats.depth = stats.enqueued > stats.dequeued ?
+                stats.enqueued - stats.dequeued : 0;
+  stats.highWater = highWater.load(memory_order_relaxed);
+  stats.producerBlocked = producerBlocked.load(memory_order_relaxed);
+  stats.consumerBlocked = consumerBlocked.load(memory_order_relaxed);
+  return stats;
+
+}
+
+/*
+  tag tells apart the messages, even those repeating a sequence number, and
+  part is the position of the service in the message out of parts services.
+  origin is the connection the message came from, with -U or -T. Items of a
+  pipeline carry the index of its stages, -1 otherwise, and their position
+  in it. priority picks the queue of the service the item waits in
+*/
+struct BufferInMiddleEnd {
+  long long number1;
+  long long number2;
+  int sequence;
+  unsigned int tag;
+  unsigned int delay : 30;
+  unsigned int priority : 2;
+  // Packed so an item takes 32 bytes, two to a cache line
+  unsigned int part : 4;
+  unsigned int parts : 5;
+  unsigned int stage : 2;
+  int pipeline : 13;
+  unsigned int origin : 8;
+};
+
+static_assert(sizeof(BufferInMiddleEnd) == 32, "BufferInMiddleEnd grew");
+static_assert(MAX_MESSAGE_SERVICES <= 16 && MAX_PIPELINE_STAGES <= 4 &&
+              PIPELINES <= 4096 && MAX_CONNECTIONS <= 256 &&
+              PRIORITIES <= 4 && DELAY_LIMIT <= 1 << 30,
+              "BufferInMiddleEnd fields too narrow");
+
+/*
+  A validated message: sequence:services:number1:number2:delays[:priority].
+  The delays are already matched one to one with the services. A service
+  may be a pipeline of stages; services and delays hold its first stage and
+  the stages fields all of them. Stage s takes operands[s] as its second
+  number, the last one when there are fewer
+*/
+struct Message {
+  int sequence;
+  int priority;
+  int servicesCount;
+  long long number1;
+  long long number2;
+  unsigned char services[MAX_MESSAGE_SERVICES];
+  unsigned int delays[MAX_MESSAGE_SERVICES];
+  unsigned char stages[MAX_MESSAGE_SERVICES];
+  unsigned char stageServices[MAX_MESSAGE_SERVICES][MAX_PIPELINE_STAGES];
+  unsigned int stageDelays[MAX_MESSAGE_SERVICES][MAX_PIPELINE_STAGES];
+  int operandsCount;
+  long long operands[MAX_PIPELINE_STAGES];
+};
+
+/*
+  Binary input (--binary): a header, then one fixed size record per message,
+  little endian. Services are a bit mask, bit i asking for service i, and
+  the delay of service i is delays[i]; services are sent in increasing order
+*/
+struct BinaryHeader {
+  char magic[4];
+  uint16_t version;
+  uint16_t recordSize;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+struct BinaryRecord {
+  int32_t sequence;
+  uint16_t services;
+  uint16_t priority;
+  int64_t number1;
+  int64_t number2;
+  uint32_t delays[BINARY_SERVICES];
+};
+
+/*
+  Binary output (-O binary and -O columns): a header, then fixed size
+  records or blocks of columns, little endian. format is OUTPUT_BINARY or
+  OUTPUT_COLUMNS and status one of the ITEM_* values
+*/
+struct ResultHeader {
+  char magic[4];
+  uint16_t version;
+  uint16_t format;
+  uint32_t recordSize;
+  uint32_t reserved;
+};
+
+struct ResultRecord {
+  int32_t sequence;
+  uint8_t service;
+  uint8_t status;
+  uint16_t reserved;
+  int64_t result;
+};
+
+/*
+  A block of columns is this header followed by count results, count
+  sequences, count services and count statuses, padded to 8 bytes
+*/
+struct ColumnBlockHeader {
+  uint32_t count;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(BinaryHeader) == 16, "binary header must be 16 bytes");
+static_assert(sizeof(ResultHeader) == 16, "result header must be 16 bytes");
+static_assert(sizeof(ResultRecord) == 16, "result records must be 16 bytes");
+static_assert(sizeof(BinaryRecord) == 64, "binary records must be 64 bytes");
+static_assert(sizeof(ParsimShmMessage) == sizeof(BinaryRecord) &&
+              sizeof(ParsimShmResult) == sizeof(ResultRecord),
+              "shared memory records must be the binary ones");
+
+struct BufferInBackEnd {
+  int sequence;
+  unsigned int tag;
+  long long result;
+  short service;
+  short status;
+  unsigned char part;
+  unsigned char parts;
+  unsigned short origin;
+};
+
+class Service;
+
+/*
+  Items a worker has already taken off a service queue and that are waiting for
+  their delay to expire. It is a binary min-heap ordered by due time; items
+  due at the same instant keep their arrival order. Each item remembers the
+  service it was taken from, because idle workers steal from other services.
+  The capacity is fixed when the worker starts so nothing is allocated while
+  running.
+*/
+class DelayHeap {
   private:
-    int defaultQueueSize;
-    int activeServices;
-    bool backendQueueSent;
-    bool defaultQueueSent;
+    struct ParkedItem {
+      long long due;
+      unsigned long order;
+      Service * owner;
+      BufferInMiddleEnd item;
+    };
+    ParkedItem * parked;
+    int capacity;
+    int count;
+    unsigned long arrivals;
+    static bool later(const ParkedItem &, const ParkedItem &);
   public:
-    FrontEnd();
-    vector<string> splitMessage(string, char);
-    bool messageValidations(vector<string>);
-    bool isNumber(string &, bool);
-    bool allIntegersInVector(vector<string>, bool);
-    void initServices(int, char **,  BackEnd *, MiddleEnd *);
-    void startService(int, char **, int, MiddleEnd *, BackEnd *);
-    void startBackendService(int, char **, int, BackEnd *);
-    void setDefaultQueueSize(int, char **, int);
-    void serviceValidations(string);
-    void setProducer(vector<string>, MiddleEnd *);
-    void waitForMessages(MiddleEnd *);
+    void init(int);
+    bool empty();
+    bool full(int = 0);
+    long long nextDue();
+    void park(BufferInMiddleEnd &, long long, Service *);
+    Service * release(BufferInMiddleEnd &);
 };
 
-FrontEnd::FrontEnd(void){
-  defaultQueueSize = 1;
+bool DelayHeap::later(const ParkedItem & a, const ParkedItem & b) {
+  return a.due > b.due || (a.due == b.due && a.order > b.order);
+}
+
+void DelayHeap::init(int capacity) {
+  this->capacity = capacity;
+  parked = (ParkedItem *) arena.allocate(capacity * sizeof(ParkedItem));
+  count = 0;
+  arrivals = 0;
+}
+
+bool DelayHeap::empty() {
+  return count == 0;
+}
+
+/* Whether there is no room left once held more items come back to it */
+bool DelayHeap::full(int held) {
+  return count + held >= capacity;
+}
+
+long long DelayHeap::nextDue() {
+  return parked[0].due;
+}
+
+void DelayHeap::park(BufferInMiddleEnd & item, long long due,
+                     Service * owner) {
+  parked[count].due = due;
+  parked[count].order = arrivals++;
+  parked[count].owner = owner;
+  parked[count].item = item;
+  count++;
+  push_heap(parked, parked + count, later);
+}
+
+/* Removes the item with the earliest due time and returns its service */
+Service * DelayHeap::release(BufferInMiddleEnd & item) {
+  pop_heap(parked, parked + count, later);
+  count--;
+  item = parked[count].item;
+  return parked[count].owner;
+}
+
+/* Writes the whole iovec array, resuming after partial writes */
+static void writeAll(int fd, iovec * vector, int count) {
+
+  while (count > 0) {
+    ssize_t written = writev(fd, vector, count);
+
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      perror("write");
+      return;
+    }
+
+    while (count > 0 && (size_t) written >= vector->iov_len) {
+      written -= vector->iov_len;
+      vector++;
+      count--;
+    }
+    if (count > 0) {
+      vector->iov_base = (char *) vector->iov_base + written;
+      vector->iov_len -= written;
+    }
+  }
+
+}
+
+/*
+  A minimal io_uring, driven through its system calls: the submission and
+  completion rings are mapped from the kernel, requests are prepared in the
+  first one and sent together with a single io_uring_enter, which can also
+  wait for their completions. Every request reads or writes at the current
+  position of its file, so pipes work like files. Only one thread uses a
+  ring
+*/
+class IoRing {
+  private:
+    int fd;
+    unsigned * sqTail;
+    unsigned sqMask;
+    unsigned * sqArray;
+    io_uring_sqe * sqes;
+    unsigned * cqHead;
+    unsigned * cqTail;
+    unsigned cqMask;
+    io_uring_cqe * cqes;
+    unsigned prepared;
+  public:
+    IoRing();
+    bool init(unsigned);
+    bool registerBuffers(iovec *, int);
+    void prepare(int, int, char *, unsigned, int, bool, unsigned long long);
+    void submit(unsigned);
+    void complete(unsigned long long &, int &);
+};
+
+IoRing::IoRing() {
+  fd = -1;
+  prepared = 0;
+}
+
+/* Room for entries requests in flight. False when the kernel has no io_uring */
+bool IoRing::init(unsigned entries) {
+
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) return false;
+
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqSize = params.cq_off.cqes +
+                  params.cq_entries * sizeof(io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) sqSize = cqSize = max(sqSize, cqSize);
+
+  char * sq = (char *) mmap(NULL, sqSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  char * cq = single ? sq :
+              (char *) mmap(NULL, cqSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  sqes = (io_uring_sqe *) mmap(NULL, params.sq_entries * sizeof(io_uring_sqe),
+                               PROT_READ | PROT_WRITE, MAP_SHARED |
+                               MAP_POPULATE, fd, IORING_OFF_SQES);
+
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+
+  sqTail = (unsigned *) (sq + params.sq_off.tail);
+  sqMask = *(unsigned *) (sq + params.sq_off.ring_mask);
+  sqArray = (unsigned *) (sq + params.sq_off.array);
+  cqHead = (unsigned *) (cq + params.cq_off.head);
+  cqTail = (unsigned *) (cq + params.cq_off.tail);
+  cqMask = *(unsigned *) (cq + params.cq_off.ring_mask);
+  cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  return true;
+
+}
+
+/* Pins the buffers, so fixed reads and writes skip mapping them each time */
+bool IoRing::registerBuffers(iovec * buffers, int count) {
+  return syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers,
+                 count) == 0;
+}
+
+/*
+  Adds a fixed read or write of length bytes at buffer, which is inside
+  registered buffer index. A linked request only starts once the previous
+  one completed in full; otherwise the rest of the chain is cancelled
+*/
+void IoRing::prepare(int opcode, int file, char * buffer, unsigned length,
+                     int index, bool linked, unsigned long long data) {
+
+  // Only this thread moves the tail, so it can be read plainly
+  unsigned slot = (*sqTail + prepared) & sqMask;
+  io_uring_sqe * sqe = &sqes[slot];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = file;
+  sqe->addr = (unsigned long) buffer;
+  sqe->len = length;
+  sqe->off = (unsigned long long) -1;
+  sqe->buf_index = index;
+  sqe->flags = linked ? IOSQE_IO_LINK : 0;
+  sqe->user_data = data;
+  sqArray[slot] = slot;
+  prepared++;
+
+}
+
+/*
+  Sends the prepared requests and waits until wait of them complete, with
+  one system call. An interrupted call submitted nothing, so it is retried
+*/
+void IoRing::submit(unsigned wait) {
+
+  __atomic_store_n(sqTail, *sqTail + prepared, __ATOMIC_RELEASE);
+
+  while (syscall(__NR_io_uring_enter, fd, prepared, wait,
+                 wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0 &&
+         errno == EINTR) {
+  }
+  prepared = 0;
+
+}
+
+/* Takes the next completion, waiting for it if there is none yet */
+void IoRing::complete(unsigned long long & data, int & result) {
+
+  while (true) {
+    unsigned head = *cqHead;
+
+    if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      io_uring_cqe * cqe = &cqes[head & cqMask];
+      data = cqe->user_data;
+      result = cqe->res;
+      __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+      return;
+    }
+
+    syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+  }
+
+}
+
+/*
+  Reads a file descriptor in blocks of INPUT_BLOCK_SIZE. With io_uring the
+  read of the next block is already in flight, into the other of two
+  registered buffers, while the caller parses the current one. Without it,
+  or when the kernel can't read at the current position (before 5.6), it
+  uses plain reads
+*/
+class BlockReader {
+  private:
+    int fd;
+    IoRing ring;
+    bool uring;
+    bool started;
+    char * buffers[2];
+    void queue(int);
+  public:
+    void open(int, bool);
+    int next(char *&);
+};
+
+void BlockReader::open(int fd, bool useRing) {
+
+  this->fd = fd;
+  started = false;
+
+  iovec vector[2];
+  for (int i = 0; i < 2; i++) {
+    buffers[i] = new char[INPUT_BLOCK_SIZE];
+    vector[i].iov_base = buffers[i];
+    vector[i].iov_len = INPUT_BLOCK_SIZE;
+  }
+
+  uring = useRing && ring.init(2) && ring.registerBuffers(vector, 2);
+  if (uring) queue(0);
+
+}
+
+void BlockReader::queue(int buffer) {
+  ring.prepare(IORING_OP_READ_FIXED, fd, buffers[buffer], INPUT_BLOCK_SIZE,
+               buffer, false, buffer);
+  ring.submit(0);
+}
+
+/*
+  The next block, which stays valid until the following call. Returns its
+  length, 0 once the input is over
+*/
+int BlockReader::next(char *& data) {
+
+  while (uring) {
+    unsigned long long buffer;
+    int result;
+    ring.complete(buffer, result);
+
+    if (result == -EINTR || result == -EAGAIN) {
+      queue(buffer);
+      continue;
+    }
+    if (result == -EINVAL && !started) {
+      uring = false;
+      break;
+    }
+    if (result <= 0) return 0;
+
+    started = true;
+    queue(1 - buffer);
+    data = buffers[buffer];
+    return result;
+  }
+
+  ssize_t count;
+  do {
+    count = read(fd, buffers[0], INPUT_BLOCK_SIZE);
+  } while (count < 0 && errno == EINTR);
+
+  data = buffers[0];
+  return count > 0 ? count : 0;
+
+}
+
+/* Writes a number in decimal and returns how many characters it took */
+static int formatNumber(char * out, long long number) {
+
+  char digits[24];
+  int length = 0;
+  int written = 0;
+  unsigned long long value = number < 0 ? 0 - (unsigned long long) number :
+                                          (unsigned long long) number;
+
+  do {
+    digits[length++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+
+  if (number < 0) out[written++] = '-';
+  while (length > 0) out[written++] = digits[--length];
+
+  return written;
+
+}
+
+/*
+  Output stage of the BackEnd. Results are formatted into large buffers and
+  a dedicated thread writes the full ones, several at a time with writev,
+  so the BackEnd never waits for the terminal or the pipe. Buffers travel
+  between both threads through two rings: full ones to the writer and
+  written ones back to the BackEnd. With --io-uring the buffers are
+  registered with the kernel and written through an IoRing instead.
+*/
+class ResultWriter {
+  private:
+    char * buffers[OUTPUT_BUFFERS];
+    int lengths[OUTPUT_BUFFERS];
+    int bufferSize;
+    int current;
+    int fd;
+    pid_t thread;
+    RingQueue<int, false, false> fullBuffers;
+    RingQueue<int, false, false> freeBuffers;
+    IoRing ring;
+    bool uring;
+    void submit(int *, int);
+  public:
+    void start(int, int, const cpu_set_t *, bool);
+    char * reserve(int = MAX_RESULT_LENGTH);
+    void commit(int);
+    int pending();
+    void flush();
+    void stop();
+    static int write(void *);
+};
+
+/* With useRing the buffers go out through io_uring when the kernel has it */
+void ResultWriter::start(int fd, int bufferSize, const cpu_set_t * cpus,
+                         bool useRing) {
+
+  this->fd = fd;
+  this->bufferSize = bufferSize;
+
+  fullBuffers.init(OUTPUT_BUFFERS);
+  freeBuffers.init(OUTPUT_BUFFERS);
+
+  iovec vector[OUTPUT_BUFFERS];
+  for (int i = 0; i < OUTPUT_BUFFERS; i++) {
+    buffers[i] = (char *) arena.allocate(bufferSize);
+    lengths[i] = 0;
+    vector[i].iov_base = buffers[i];
+    vector[i].iov_len = bufferSize;
+    if (i > 0) freeBuffers.push(i);
+  }
+  current = 0;
+
+  uring = useRing && ring.init(OUTPUT_BUFFERS) &&
+          ring.registerBuffers(vector, OUTPUT_BUFFERS);
+
+  thread = spawnThread(ResultWriter::write, this, cpus);
+
+}
+
+/*
+  Room for length more bytes, one result of at most MAX_RESULT_LENGTH
+  characters by default. A full buffer is handed to the writer first
+*/
+char * ResultWriter::reserve(int length) {
+
+  if (lengths[current] + length > bufferSize) {
+    flush();
+  }
+
+  return buffers[current] + lengths[current];
+
+}
+
+void ResultWriter::commit(int length) {
+  lengths[current] += length;
+}
+
+/* Bytes formatted but not yet handed to the writer */
+int ResultWriter::pending() {
+  return lengths[current];
+}
+
+void ResultWriter::flush() {
+
+  if (lengths[current] == 0) return;
+
+  fullBuffers.push(current);
+  freeBuffers.pop(current);
+  lengths[current] = 0;
+
+}
+
+/* Hands over what is left and waits until everything is written */
+void ResultWriter::stop() {
+
+  flush();
+  fullBuffers.close();
+  joinThread(thread);
+
+}
+
+/*
+  Writes the taken buffers with one io_uring_enter, linked so they land in
+  order. What a short write or an error left out, and the writes it
+  cancelled, go out with writev afterwards
+*/
+void ResultWriter::submit(int * taken, int count) {
+
+  int written[OUTPUT_BUFFERS];
+  iovec vector[OUTPUT_BUFFERS];
+  int left = 0;
+
+  for (int i = 0; i < count; i++) {
+    ring.prepare(IORING_OP_WRITE_FIXED, fd, buffers[taken[i]],
+                 lengths[taken[i]], taken[i], i < count - 1, i);
+  }
+  ring.submit(count);
+
+  for (int i = 0; i < count; i++) {
+    unsigned long long request;
+    int result;
+    ring.complete(request, result);
+    written[request] = max(result, 0);
+    // Kernels before 5.6 can't write at the current position
+    if (result == -EINVAL) uring = false;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (left == 0 && written[i] == lengths[taken[i]]) continue;
+    vector[left].iov_base = buffers[taken[i]] + written[i];
+    vector[left].iov_len = lengths[taken[i]] - written[i];
+    left++;
+  }
+  if (left > 0) writeAll(fd, vector, left);
+
+}
+
+int ResultWriter::write(void * arg) {
+
+  ResultWriter * writer = (ResultWriter*) arg;
+  iovec vector[OUTPUT_BUFFERS];
+  int taken[OUTPUT_BUFFERS];
+  int count;
+
+  while (writer->fullBuffers.pop(taken[0])) {
+
+    // Whatever else is already full goes out in the same system call
+    count = 1;
+    while (count < OUTPUT_BUFFERS && writer->fullBuffers.tryPop(taken[count])) {
+      count++;
+    }
+
+    if (writer->uring) {
+      writer->submit(taken, count);
+    } else {
+      for (int i = 0; i < count; i++) {
+        vector[i].iov_base = writer->buffers[taken[i]];
+        vector[i].iov_len = writer->lengths[taken[i]];
+      }
+      writeAll(writer->fd, vector, count);
+    }
+
+    for (int i = 0; i < count; i++) {
+      writer->freeBuffers.push(taken[i]);
+    }
+  }
+
+  return 0;
+
+}
+
+/* Results gathered for one message, in the order of its services */
+struct MessageRecord {
+  unsigned int tag;
+  int sequence;
+  bool used;
+  bool expired;
+  unsigned char parts;
+  unsigned char received;
+  unsigned short origin;
+  long long deadline;
+  unsigned char services[MAX_MESSAGE_SERVICES];
+  unsigned char status[MAX_MESSAGE_SERVICES];
+  long long results[MAX_MESSAGE_SERVICES];
+};
+
+/*
+  Results of the messages that fan out to several services, kept until every
+  service has answered so they leave as a single record. It is an open
+  addressing table with linear probing keyed by the message tag, sized for
+  every item the services hold when they start so it never grows. Tags are also
+  queued in the order messages opened, which is the order they time out in.
+  Finished messages leave their tag behind in that queue until it fills up
+  and is compacted. When the table itself is full the oldest message is
+  given up early.
+  A message that timed out stays in the table, marked expired, until its
+  late parts arrive.
+*/
+class Aggregator {
+  private:
+    MessageRecord * records;
+    unsigned int * opened;
+    unsigned int slots;
+    unsigned long first;
+    unsigned long last;
+    unsigned int count;
+    long long timeout;
+  public:
+    void init(int, long long);
+    MessageRecord * find(unsigned int);
+    MessageRecord * open(BufferInBackEnd &, long long);
+    MessageRecord * oldest();
+    MessageRecord * evict();
+    bool full();
+    void compact();
+    MessageRecord * expired(long long);
+    long long nextDeadline();
+    void remove(MessageRecord *);
+};
+
+void Aggregator::init(int capacity, long long timeout) {
+
+  this->timeout = timeout;
+  slots = MIN_AGGREGATION_SLOTS;
+  while (slots < 2 * (unsigned int) capacity) slots *= 2;
+
+  records = new MessageRecord[slots];
+  opened = new unsigned int[slots];
+  for (unsigned int i = 0; i < slots; i++) records[i].used = false;
+  first = last = 0;
+  count = 0;
+
+}
+
+MessageRecord * Aggregator::find(unsigned int tag) {
+
+  for (unsigned int i = tag & (slots - 1); records[i].used;
+       i = (i + 1) & (slots - 1)) {
+    if (records[i].tag == tag) return &records[i];
+  }
+
+  return NULL;
+
+}
+
+/* Starts the record of the message item belongs to. See evict first */
+MessageRecord * Aggregator::open(BufferInBackEnd & item, long long now) {
+
+  unsigned int i = item.tag & (slots - 1);
+  while (records[i].used) i = (i + 1) & (slots - 1);
+
+  MessageRecord & record = records[i];
+  record.tag = item.tag;
+  record.sequence = item.sequence;
+  record.used = true;
+  record.expired = false;
+  record.parts = item.parts;
+  record.received = 0;
+  record.deadline = now + timeout;
+  memset(record.status, ITEM_MISSING, item.parts);
+
+  opened[last++ & (slots - 1)] = item.tag;
+  count++;
+
+  return &record;
+
+}
+
+/* Takes the message opened first and not finished yet, if any */
+MessageRecord * Aggregator::oldest() {
+
+  while (first != last) {
+    MessageRecord * record = find(opened[first++ & (slots - 1)]);
+    if (record != NULL) return record;
+  }
+
+  return NULL;
+
+}
+
+bool Aggregator::full() {
+  return 2 * count >= slots;
+}
+
+/* Drops from the queue of tags the messages that are no longer open */
+void Aggregator::compact() {
+
+  unsigned long kept = first;
+
+  for (unsigned long i = first; i != last; i++) {
+    MessageRecord * record = find(opened[i & (slots - 1)]);
+    if (record != NULL && !record->expired) {
+      opened[kept++ & (slots - 1)] = record->tag;
+    }
+  }
+  last = kept;
+
+}
+
+/*
+  Returns the record to give up before another message fits, or NULL when
+  there is room. Only expired records are left when no message is open
+*/
+MessageRecord * Aggregator::evict() {
+
+  if (!full()) {
+    if (last - first == slots) compact();
+    return NULL;
+  }
+
+  MessageRecord * record = oldest();
+  if (record != NULL) return record;
+
+  for (unsigned int i = 0; i < slots; i++) {
+    if (records[i].used) return &records[i];
+  }
+  return NULL;
+
+}
+
+/* Takes the next open message whose timeout is over, if any */
+MessageRecord * Aggregator::expired(long long now) {
+
+  long long deadline = nextDeadline();
+
+  if (deadline == 0 || deadline > now) return NULL;
+  return oldest();
+
+}
+
+/* When the oldest open message times out, 0 if there is none */
+long long Aggregator::nextDeadline() {
+
+  while (first != last) {
+    MessageRecord * record = find(opened[first & (slots - 1)]);
+    if (record != NULL) return record->deadline;
+    first++;
+  }
+
+  return 0;
+
+}
+
+/*
+  Frees the slot of record, moving back the records after it that would not
+  be found anymore otherwise. Pointers to other records are no longer valid
+*/
+void Aggregator::remove(MessageRecord * record) {
+
+  unsigned int hole = record - records;
+  unsigned int next = hole;
+
+  while (true) {
+    next = (next + 1) & (slots - 1);
+    if (!records[next].used) break;
+
+    unsigned int home = records[next].tag & (slots - 1);
+    if (((next - home) & (slots - 1)) >= ((next - hole) & (slots - 1))) {
+      records[hole] = records[next];
+      hole = next;
+    }
+  }
+
+  records[hole].used = false;
+  count--;
+
+}
+
+/*
+  Reorder buffer of --ordered. Every message owns the slot of its tag modulo
+  the size of the window, and messages leave in tag order, which is input
+  order, as soon as the oldest one is complete. The FrontEnd only sends a
+  message once its slot is free, so a lagging service slows the input down
+  instead of making the buffer grow.
+*/
+class ReorderWindow {
+  private:
+    MessageRecord * records;
+    unsigned int size;
+    // Tag of the oldest message not written yet, the FrontEnd waits on it
+    alignas(CACHE_LINE_SIZE) atomic<int> head;
+    atomic<int> waiting;
+    atomic<int> wanted;
+  public:
+    void init(int);
+    void admit(unsigned int);
+    bool holds(unsigned int);
+    MessageRecord & slot(unsigned int);
+    MessageRecord & oldest();
+    void release();
+};
+
+/* The size is rounded up to a power of two */
+void ReorderWindow::init(int size) {
+
+  this->size = 4;
+  while (this->size < (unsigned int) size) this->size *= 2;
+
+  records = new MessageRecord[this->size];
+  for (unsigned int i = 0; i < this->size; i++) records[i].received = 0;
+  head = 0;
+  waiting = 0;
+
+}
+
+/*
+  Waits until the message with tag has a slot. Once the window is full the
+  FrontEnd waits for a quarter of it to be written, not for every message
+*/
+void ReorderWindow::admit(unsigned int tag) {
+
+  if (tag - (unsigned int) head.load() < size) return;
+
+  unsigned int target = tag - size + size / 4 + 1;
+  wanted.store(target);
+  waiting.store(1);
+
+  int observed;
+  while ((int) (target - (unsigned int) (observed = head.load())) > 0) {
+    futexWait(&head, observed);
+  }
+
+  waiting.store(0);
+
+}
+
+/* Whether the message is still in the window rather than already written */
+bool ReorderWindow::holds(unsigned int tag) {
+  return tag - (unsigned int) head.load(memory_order_relaxed) < size;
+}
+
+MessageRecord & ReorderWindow::slot(unsigned int tag) {
+  return records[tag & (size - 1)];
+}
+
+MessageRecord & ReorderWindow::oldest() {
+  return slot(head.load(memory_order_relaxed));
+}
+
+/* Frees the slot of the oldest message */
+void ReorderWindow::release() {
+
+  oldest().received = 0;
+
+  unsigned int next = (unsigned int) head.load(memory_order_relaxed) + 1;
+  head.store(next);
+
+  if (waiting.load() && (int) (next - (unsigned int) wanted.load()) >= 0) {
+    futexWake(&head, 1);
+  }
+
+}
+
+/*
+  A client of -U or -T. The FrontEnd reads its messages from readFd and the
+  BackEnd writes its results to writeFd, a duplicate of the same socket, so
+  each side closes its own descriptor. Once the client is done the FrontEnd
+  tells the BackEnd how many items it dispatched; the slot is free again
+  when every one of them has been written. The buffers are allocated by the
+  FrontEnd the first time the slot is used and kept afterwards.
+*/
+struct Connection {
+  atomic<int> state;
+  // Used by the FrontEnd only
+  int readFd;
+  char * input;
+  int inputLength;
+  unsigned long dispatched;
+  // Used by the BackEnd only
+  int writeFd;
+  char * output;
+  int outputLength;
+  bool broken;
+  unsigned long accepted;
+  long long expected;
+  unsigned int lastTag;
+};
+
+class BackEnd {
+  private:
+    // Every Service produces here, only the BackEnd thread consumes
+    RingQueue<BufferInBackEnd, true, false> itemsBackEnd;
+    ResultWriter writer;
+    pid_t thread;
+    int flushPolicy;
+    int flushBytes;
+    long long flushInterval;
+    bool aggregating;
+    long long aggregationTimeout;
+    Aggregator aggregator;
+    bool ordering;
+    int orderWindow;
+    ReorderWindow window;
+    int outputFormat;
+    int outputFd;
+    bool outputRing;
+    // Clients of -U and -T, NULL when results go to outputFd
+    Connection * connections;
+    // Rings of -S, NULL when results go to outputFd
+    ParsimShm * shared;
+    int replyOrigin;
+    int replyPending;
+    int closingConnections;
+    char discarded[MAX_RESULT_LENGTH];
+    // Results of the column block being filled with -O columns
+    int columnCount;
+    int64_t columnResults[COLUMN_BLOCK_SIZE];
+    int32_t columnSequences[COLUMN_BLOCK_SIZE];
+    uint8_t columnServices[COLUMN_BLOCK_SIZE];
+    uint8_t columnStatus[COLUMN_BLOCK_SIZE];
+    char * reserve(int = MAX_RESULT_LENGTH);
+    void commit(int);
+    void emit(int, int, int, long long);
+    void writeHeader();
+    void writeColumns();
+    void control(BufferInBackEnd &);
+    void sendConnection(int);
+    void releaseConnections();
+    int pending();
+    void flush();
+    void write(int, int, long long);
+    void writeError(int, int, int);
+    void writeRecord(MessageRecord &);
+    void writeOrdered(MessageRecord &);
+    void accept(BufferInBackEnd &, long long);
+    void aggregate(BufferInBackEnd &, long long);
+    void order(BufferInBackEnd &, long long);
+    void releaseOrdered(long long);
+    long long nextDeadline();
+    void expire(long long);
+    void finish();
+  public:
+    BackEnd();
+    static int consume (void *);
+    void produce(BufferInBackEnd);
+    void admit(unsigned int);
+    void setFlushPolicy(int, long long);
+    void setAggregation(long long);
+    void setOrdering(int);
+    void setOutput(int, int, bool);
+    void setConnections(Connection *);
+    void setShared(ParsimShm *);
+    QueueStats getQueueStats();
+    void start (int, int, const cpu_set_t *);
+    void stop ();
+};
+
+BackEnd::BackEnd() {
+  flushPolicy = FLUSH_IMMEDIATE;
+  flushBytes = OUTPUT_BUFFER_SIZE;
+  flushInterval = 0;
+  aggregating = false;
+  aggregationTimeout = 0;
+  ordering = false;
+  outputFormat = OUTPUT_TEXT;
+  outputFd = STDOUT_FILENO;
+  outputRing = false;
+  connections = NULL;
+  shared = NULL;
+  replyOrigin = -1;
+  replyPending = 0;
+  closingConnections = 0;
+  columnCount = 0;
+}
+
+/*
+  immediate: results are written as soon as the queue runs empty
+  size: results are written once amount bytes are formatted
+  time: results are written at most amount milliseconds after being formatted
+*/
+void BackEnd::setFlushPolicy(int policy, long long amount) {
+
+  flushPolicy = policy;
+
+  if (policy == FLUSH_SIZE) {
+    flushBytes = amount;
+  } else if (policy == FLUSH_TIME) {
+    flushInterval = amount * 1000000LL;
+  }
+
+}
+
+/* Results of a message are joined, waiting at most timeout milliseconds */
+void BackEnd::setAggregation(long long timeout) {
+  aggregating = true;
+  aggregationTimeout = timeout * 1000000LL;
+}
+
+/*
+  Results are written to fd as text, binary records or blocks of columns,
+  through io_uring with useRing
+*/
+void BackEnd::setOutput(int format, int fd, bool useRing) {
+  outputFormat = format;
+  outputFd = fd;
+  outputRing = useRing;
+}
+
+/* Results go back to the connection their message came from */
+void BackEnd::setConnections(Connection * connections) {
+  this->connections = connections;
+}
+
+/* Results go as binary records to the ring of results of -S */
+void BackEnd::setShared(ParsimShm * shared) {
+  this->shared = shared;
+  outputFormat = OUTPUT_BINARY;
+}
+
+/* Results are written in input order, with room for window messages */
+void BackEnd::setOrdering(int window) {
+  ordering = true;
+  orderWindow = window;
+}
+
+/*
+  itemsCapacity is how many items the services hold at once when they start.
+  Services scaled up by -e may hold more, and the aggregator then gives up
+  its oldest message sooner. The BackEnd and its writer run on cpus when it
+  isn't NULL
+*/
+void BackEnd::start(int bufferSize, int itemsCapacity,
+                    const cpu_set_t * cpus) {
+
+  itemsBackEnd.init(bufferSize);
+  if (ordering) {
+    window.init(orderWindow);
+  } else if (aggregating) {
+    aggregator.init(bufferSize + itemsCapacity, aggregationTimeout);
+  }
+  writer.start(outputFd, max(flushBytes, OUTPUT_BUFFER_SIZE) +
+                         MAX_RESULT_LENGTH, cpus, outputRing);
+
+  // Every connection gets its own header when it opens, the ring none
+  if (outputFormat != OUTPUT_TEXT && connections == NULL && shared == NULL) {
+    writeHeader();
+  }
+  thread = spawnThread(BackEnd::consume, this, cpus);
+
+}
+
+void BackEnd::produce(BufferInBackEnd item) {
+  itemsBackEnd.push(item);
+}
+
+/* Called by the FrontEnd before sending the message with tag */
+void BackEnd::admit(unsigned int tag) {
+  if (ordering) window.admit(tag);
+}
+
+QueueStats BackEnd::getQueueStats() {
+  return itemsBackEnd.stats();
+}
+
+/* Waits for the results still queued to be written */
+void BackEnd::stop() {
+
+  itemsBackEnd.close();
+  joinThread(thread);
+  writer.stop();
+  if (shared != NULL) parsimShmClose(&shared->results);
+  if (outputFd != STDOUT_FILENO) ::close(outputFd);
+
+  for (int i = 0; connections != NULL && i < MAX_CONNECTIONS; i++) {
+    if (connections[i].writeFd >= 0) ::close(connections[i].writeFd);
+  }
+
+}
+
+/*
+  Room for length more bytes of output: in the writer, or in the buffer of
+  the connection being answered. Output for a client that is already gone
+  is formatted where it is thrown away
+*/
+char * BackEnd::reserve(int length) {
+
+  if (connections == NULL) return writer.reserve(length);
+  if (replyOrigin < 0) return discarded;
+
+  Connection & connection = connections[replyOrigin];
+  if (connection.outputLength + length > CONNECTION_BUFFER_SIZE) {
+    sendConnection(replyOrigin);
+  }
+
+  return connection.output + connection.outputLength;
+
+}
+
+void BackEnd::commit(int length) {
+
+  if (connections == NULL) {
+    writer.commit(length);
+  } else if (replyOrigin >= 0) {
+    connections[replyOrigin].outputLength += length;
+    replyPending += length;
+  }
+
+}
+
+/* Starts the binary output */
+void BackEnd::writeHeader() {
+
+  ResultHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RESULT_MAGIC, sizeof(header.magic));
+  header.version = RESULT_VERSION;
+  header.format = outputFormat;
+  header.recordSize = outputFormat == OUTPUT_BINARY ? sizeof(ResultRecord) : 0;
+  memcpy(reserve(sizeof(header)), &header, sizeof(header));
+  commit(sizeof(header));
+
+}
+
+/*
+  Sends what was formatted for a connection, waiting while its socket is
+  full like the writer waits for a slow pipe. A client that went away, or
+  that takes nothing for SEND_TIMEOUT_MS, only loses its own results: it is
+  disconnected so the FrontEnd stops reading it too. Threads share errno
+  with main, so failures are told apart by poll instead
+*/
+void BackEnd::sendConnection(int origin) {
+
+  Connection & connection = connections[origin];
+  int sent = 0;
+
+  while (sent < connection.outputLength && !connection.broken) {
+    ssize_t count = send(connection.writeFd, connection.output + sent,
+                         connection.outputLength - sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if (count > 0) {
+      sent += count;
+      continue;
+    }
+
+    pollfd writable = { connection.writeFd, POLLOUT, 0 };
+    int ready = poll(&writable, 1, SEND_TIMEOUT_MS);
+
+    if (ready == 0 ||
+        (ready > 0 && (writable.revents & (POLLERR | POLLHUP | POLLNVAL)))) {
+      shutdown(connection.writeFd, SHUT_RDWR);
+      connection.broken = true;
+    }
+  }
+
+  replyPending -= connection.outputLength;
+  connection.outputLength = 0;
+
+}
+
+/* A connection opened or its client is done sending messages */
+void BackEnd::control(BufferInBackEnd & item) {
+
+  Connection & connection = connections[item.origin];
+
+  if (item.status == ITEM_OPEN) {
+    connection.writeFd = item.result;
+    connection.outputLength = 0;
+    connection.broken = false;
+    connection.accepted = 0;
+    connection.expected = -1;
+    if (outputFormat != OUTPUT_TEXT) {
+      replyOrigin = item.origin;
+      writeHeader();
+    }
+    return;
+  }
+
+  connection.expected = item.result;
+  closingConnections++;
+  releaseConnections();
+
+}
+
+/*
+  Closes the connections whose results were all written. With --ordered a
+  message may be complete and still wait for older ones in the window
+*/
+void BackEnd::releaseConnections() {
+
+  for (int i = 0; closingConnections > 0 && i < MAX_CONNECTIONS; i++) {
+    Connection & connection = connections[i];
+
+    if (connection.expected < 0 ||
+        connection.accepted != (unsigned long) connection.expected ||
+        (ordering && connection.accepted > 0 &&
+         window.holds(connection.lastTag))) {
+      continue;
+    }
+
+    sendConnection(i);
+    ::close(connection.writeFd);
+    connection.writeFd = -1;
+    connection.expected = -1;
+    closingConnections--;
+    connection.state.store(CONNECTION_FREE);
+  }
+
+}
+
+/*
+  Adds a result to the binary output, as a record or to the column block.
+  With -S the record goes straight to the ring of results, waiting while the
+  client hasn't made room like the writer waits for a slow pipe
+*/
+void BackEnd::emit(int sequence, int service, int status, long long result) {
+
+  if (outputFormat == OUTPUT_COLUMNS) {
+    columnResults[columnCount] = result;
+    columnSequences[columnCount] = sequence;
+    columnServices[columnCount] = service;
+    columnStatus[columnCount] = status;
+    if (++columnCount == COLUMN_BLOCK_SIZE) writeColumns();
+    return;
+  }
+
+  ResultRecord record;
+  record.sequence = sequence;
+  record.service = service;
+  record.status = status;
+  record.reserved = 0;
+  record.result = result;
+
+  if (shared != NULL) {
+    parsimShmPush(&shared->results, &record);
+    return;
+  }
+
+  memcpy(reserve(sizeof(record)), &record, sizeof(record));
+  commit(sizeof(record));
+
+}
+
+/* Hands the column block being filled to the writer */
+void BackEnd::writeColumns() {
+
+  if (columnCount == 0) return;
+
+  ColumnBlockHeader header;
+  header.count = columnCount;
+  header.reserved = 0;
+
+  int length = sizeof(header) + columnCount * (sizeof(int64_t) +
+               sizeof(int32_t) + 2 * sizeof(uint8_t));
+  int padded = (length + 7) / 8 * 8;
+  char * out = reserve(padded);
+
+  memcpy(out, &header, sizeof(header));
+  out += sizeof(header);
+  memcpy(out, columnResults, columnCount * sizeof(int64_t));
+  out += columnCount * sizeof(int64_t);
+  memcpy(out, columnSequences, columnCount * sizeof(int32_t));
+  out += columnCount * sizeof(int32_t);
+  memcpy(out, columnServices, columnCount);
+  out += columnCount;
+  memcpy(out, columnStatus, columnCount);
+  out += columnCount;
+  memset(out, 0, padded - length);
+
+  commit(padded);
+  columnCount = 0;
+
+}
+
+/* Bytes of results not handed to the writer thread or sent yet */
+int BackEnd::pending() {
+  return writer.pending() + replyPending +
+         columnCount * (sizeof(int64_t) + sizeof(int32_t) +
+                        2 * sizeof(uint8_t));
+}
+
+void BackEnd::flush() {
+
+  writeColumns();
+  writer.flush();
+
+  for (int i = 0; replyPending > 0 && i < MAX_CONNECTIONS; i++) {
+    if (connections[i].outputLength > 0) sendConnection(i);
+  }
+
+}
+
+/* Formats a result as sequence:service:result */
+void BackEnd::write(int sequence, int service, long long result) {
+
+  if (outputFormat != OUTPUT_TEXT) {
+    emit(sequence, service, ITEM_OK, result);
+    return;
+  }
+
+  char * out = reserve();
+  int length = formatNumber(out, sequence);
+
+  out[length++] = TWO_POINTS;
+  length += formatNumber(out + length, service);
+  out[length++] = TWO_POINTS;
+  length += formatNumber(out + length, result);
+  out[length++] = '\n';
+
+  commit(length);
+
+}
+
+/*
+  Results that could not be calculated, or that a full queue turned away, go
+  to the standard error, or to the connection that sent them
+*/
+void BackEnd::writeError(int sequence, int service, int status) {
+
+  // Binary output carries them with their status instead
+  if (outputFormat != OUTPUT_TEXT) {
+    emit(sequence, service, status, 0);
+    return;
+  }
+
+  const char * reason = status == ITEM_REJECTED ? REJECTED_ERR :
+                        status == ITEM_DROPPED ? DROPPED_ERR :
+                        DIVISION_BY_ZERO_ERR;
+  char buffer[MAX_RESULT_LENGTH];
+  char * error = connections != NULL ? reserve() : buffer;
+  int length = formatNumber(error, sequence);
+  error[length++] = TWO_POINTS;
+  length += formatNumber(error + length, service);
+  error[length++] = TWO_POINTS;
+  memcpy(error + length, reason, strlen(reason));
+  length += strlen(reason);
+  error[length++] = '\n';
+
+  if (connections != NULL) {
+    commit(length);
+  } else {
+    ::write(STDERR_FILENO, error, length);
+  }
+
+}
+
+/*
+  Formats a message as sequence:service,service...:result,result... in the
+  order the services were asked for. A result that could not be calculated
+  is written as RESULT_ERROR and a part that didn't arrive in time, together
+  with its service, as RESULT_MISSING. Binary output has no records: the
+  results are written one by one, missing parts with MISSING_SERVICE, and
+  errors were already written by writeError
+*/
+void BackEnd::writeRecord(MessageRecord & record) {
+
+  replyOrigin = record.origin;
+
+  if (outputFormat != OUTPUT_TEXT) {
+    for (int i = 0; i < record.parts; i++) {
+      if (record.status[i] == ITEM_OK) {
+        emit(record.sequence, record.services[i], ITEM_OK, record.results[i]);
+      } else if (record.status[i] == ITEM_MISSING) {
+        emit(record.sequence, MISSING_SERVICE, ITEM_MISSING, 0);
+      }
+    }
+    return;
+  }
+
+  char * out = reserve();
+  int length = formatNumber(out, record.sequence);
+
+  out[length++] = TWO_POINTS;
+  for (int i = 0; i < record.parts; i++) {
+    if (i > 0) out[length++] = COMMA;
+    if (record.status[i] == ITEM_MISSING) {
+      out[length++] = RESULT_MISSING;
+    } else {
+      length += formatNumber(out + length, record.services[i]);
+    }
+  }
+
+  out[length++] = TWO_POINTS;
+  for (int i = 0; i < record.parts; i++) {
+    if (i > 0) out[length++] = COMMA;
+    if (record.status[i] == ITEM_MISSING) {
+      out[length++] = RESULT_MISSING;
+    } else if (record.status[i] != ITEM_OK) {
+      out[length++] = RESULT_ERROR;
+    } else {
+      length += formatNumber(out + length, record.results[i]);
+    }
+  }
+  out[length++] = '\n';
+
+  commit(length);
+
+}
+
+/* Adds a result to the record of its message and writes complete records */
+void BackEnd::aggregate(BufferInBackEnd & item, long long now) {
+
+  if (item.parts == 1) {
+    if (item.status == ITEM_OK) write(item.sequence, item.service, item.result);
+    return;
+  }
+
+  MessageRecord * record = aggregator.find(item.tag);
+
+  if (record == NULL) {
+    MessageRecord * evicted;
+    while ((evicted = aggregator.evict()) != NULL) {
+      if (!evicted->expired) writeRecord(*evicted);
+      aggregator.remove(evicted);
+    }
+    record = aggregator.open(item, now);
+    record->origin = item.origin;
+  } else if (record->expired) {
+    // Its message was already written, the part goes on a line of its own
+    if (item.status == ITEM_OK) write(item.sequence, item.service, item.result);
+    if (++record->received == record->parts) aggregator.remove(record);
+    return;
+  }
+
+  record->services[item.part] = item.service;
+  record->status[item.part] = item.status;
+  record->results[item.part] = item.result;
+
+  if (++record->received == record->parts) {
+    writeRecord(*record);
+    aggregator.remove(record);
+  }
+
+}
+
+/* Keeps a result in the slot of its message until the message is written */
+void BackEnd::order(BufferInBackEnd & item, long long now) {
+
+  if (!window.holds(item.tag)) {
+    // A late part of a message that timed out goes on a line of its own
+    if (item.status != ITEM_OK) {
+      writeError(item.sequence, item.service, item.status);
+    } else {
+      write(item.sequence, item.service, item.result);
+    }
+    return;
+  }
+
+  MessageRecord & record = window.slot(item.tag);
+
+  if (record.received == 0) {
+    record.sequence = item.sequence;
+    record.parts = item.parts;
+    record.origin = item.origin;
+    record.deadline = now + aggregationTimeout;
+    memset(record.status, ITEM_MISSING, item.parts);
+  }
+
+  record.services[item.part] = item.service;
+  record.status[item.part] = item.status;
+  record.results[item.part] = item.result;
+  record.received++;
+
+  releaseOrdered(now);
+
+}
+
+/*
+  Writes the oldest messages while they are complete. With -A the oldest one
+  is also written once it waited longer than the timeout
+*/
+void BackEnd::releaseOrdered(long long now) {
+
+  while (true) {
+    MessageRecord & record = window.oldest();
+
+    if (record.received == 0 || (record.received < record.parts &&
+        (!aggregating || record.deadline > now))) {
+      return;
+    }
+
+    writeOrdered(record);
+    window.release();
+  }
+
+}
+
+/* Writes a message of the window, errors included, in service order */
+void BackEnd::writeOrdered(MessageRecord & record) {
+
+  replyOrigin = record.origin;
+
+  for (int i = 0; i < record.parts; i++) {
+    if (record.status[i] != ITEM_OK && record.status[i] != ITEM_MISSING) {
+      writeError(record.sequence, record.services[i], record.status[i]);
+    }
+  }
+
+  if (aggregating && record.parts > 1) {
+    writeRecord(record);
+    return;
+  }
+
+  for (int i = 0; i < record.parts; i++) {
+    if (record.status[i] == ITEM_OK) {
+      write(record.sequence, record.services[i], record.results[i]);
+    }
+  }
+
+}
+
+/* Hands a result to the ordering, the aggregation or straight to the output */
+void BackEnd::accept(BufferInBackEnd & item, long long now) {
+
+  if (item.status == ITEM_OPEN || item.status == ITEM_CLOSE) {
+    control(item);
+    return;
+  }
+
+  replyOrigin = item.origin;
+
+  if (ordering) {
+    order(item, now);
+  } else {
+    if (item.status != ITEM_OK) {
+      writeError(item.sequence, item.service, item.status);
+    }
+
+    if (aggregating) {
+      aggregate(item, now);
+    } else if (item.status == ITEM_OK) {
+      write(item.sequence, item.service, item.result);
+    }
+  }
+
+  if (connections != NULL) {
+    Connection & connection = connections[item.origin];
+    if (connection.accepted++ == 0 ||
+        (int) (item.tag - connection.lastTag) > 0) {
+      connection.lastTag = item.tag;
+    }
+    if (closingConnections > 0) releaseConnections();
+  }
+
+}
+
+/* When the next message times out, 0 if none can */
+long long BackEnd::nextDeadline() {
+
+  if (!aggregating) return 0;
+
+  if (ordering) {
+    MessageRecord & record = window.oldest();
+    return record.received > 0 ? record.deadline : 0;
+  }
+
+  return aggregator.nextDeadline();
+
+}
+
+/* Writes what arrived of the messages that waited too long */
+void BackEnd::expire(long long now) {
+
+  if (ordering) {
+    releaseOrdered(now);
+    if (closingConnections > 0) releaseConnections();
+    return;
+  }
+
+  MessageRecord * record;
+
+  while ((record = aggregator.expired(now)) != NULL) {
+    writeRecord(*record);
+    record->expired = true;
+  }
+
+}
+
+/* Messages still missing parts are written with what they have */
+void BackEnd::finish() {
+
+  if (ordering) {
+    while (window.oldest().received > 0) {
+      writeOrdered(window.oldest());
+      window.release();
+    }
+    return;
+  }
+
+  MessageRecord * record;
+
+  while (aggregating && (record = aggregator.oldest()) != NULL) {
+    writeRecord(*record);
+    aggregator.remove(record);
+  }
+
+}
+
+int BackEnd::consume (void * arg) {
+
+  //Get the reference of the BackEnd
+  BackEnd * backEnd = (BackEnd*) arg;
+  RingQueue<BufferInBackEnd, true, false> & items = backEnd->itemsBackEnd;
+  BufferInBackEnd item;
+  int policy = backEnd->flushPolicy;
+  bool aggregating = backEnd->aggregating;
+  long long flushAt = 0;
+  long long now = 0;
+
+  while (true) {
+
+    bool popped;
+    int pending = backEnd->pending();
+    // Wake up for the next message timing out or for the next time flush
+    long long deadline = backEnd->nextDeadline();
+
+    if (pending > 0 && policy == FLUSH_TIME &&
+        (deadline == 0 || flushAt < deadline)) {
+      deadline = flushAt;
+    }
+
+    if (pending > 0 && policy == FLUSH_IMMEDIATE) {
+      popped = items.tryPop(item);
+    } else if (deadline == 0) {
+      popped = items.pop(item);
+    } else {
+      popped = items.popUntil(item, deadline);
+    }
+
+    if (!popped && items.drained()) break;
+
+    if (aggregating || policy == FLUSH_TIME) now = monotonicNow();
+
+    //Print result to the user
+    if (popped) backEnd->accept(item, now);
+
+    if (aggregating) backEnd->expire(now);
+
+    if (pending == 0 && backEnd->pending() > 0) {
+      flushAt = now + backEnd->flushInterval;
+    }
+
+    if (popped ? policy == FLUSH_SIZE &&
+                 backEnd->pending() >= backEnd->flushBytes :
+                 policy == FLUSH_IMMEDIATE ||
+                 (policy == FLUSH_TIME && now >= flushAt)) {
+      // Nothing else is ready, the oldest result waited long enough or
+      // there is enough to write
+      backEnd->flush();
+    }
+  }
+
+  backEnd->finish();
+  backEnd->flush();
+
+  return 0;
+
+}
+
+/*
+  Operations of the services. apply works on one pair of operands, and the
+  vector versions, when vector says an operation has them, on 4 (AVX2) or 8
+  (AVX-512) pairs at once. defined tells whether the operation has a result
+  for a pair; dividing the smallest number by -1 wraps around like the other
+  operations do instead of trapping.
+*/
+struct OpSum {
+  static const bool vector = true;
+  static bool defined(long long, long long) { return true; }
+  static long long apply(long long a, long long b) { return a + b; }
+  __attribute__((target("avx2")))
+  static __m256i apply(__m256i a, __m256i b) { return _mm256_add_epi64(a, b); }
+  __attribute__((target("avx512f,avx512dq")))
+  static __m512i apply(__m512i a, __m512i b) { return _mm512_add_epi64(a, b); }
+};
+
+struct OpSub {
+  static const bool vector = true;
+  static bool defined(long long, long long) { return true; }
+  static long long apply(long long a, long long b) { return a - b; }
+  __attribute__((target("avx2")))
+  static __m256i apply(__m256i a, __m256i b) { return _mm256_sub_epi64(a, b); }
+  __attribute__((target("avx512f,avx512dq")))
+  static __m512i apply(__m512i a, __m512i b) { return _mm512_sub_epi64(a, b); }
+};
+
+struct OpMult {
+  static const bool vector = true;
+  static bool defined(long long, long long) { return true; }
+  static long long apply(long long a, long long b) {
+    return (long long) ((unsigned long long) a * (unsigned long long) b);
+  }
+  /* AVX2 has no 64 bit multiplication: build it from 32 bit halves */
+  __attribute__((target("avx2")))
+  static __m256i apply(__m256i a, __m256i b) {
+    __m256i low = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(
+                      _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                      _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+  }
+  __attribute__((target("avx512f,avx512dq")))
+  static __m512i apply(__m512i a, __m512i b) {
+    return _mm512_mullo_epi64(a, b);
+  }
+};
+
+struct OpDiv {
+  static const bool vector = false;
+  static bool defined(long long, long long b) { return b != 0; }
+  static long long apply(long long a, long long b) {
+    return b == -1 ? (long long) (0 - (unsigned long long) a) : a / b;
+  }
+};
+
+struct OpMod {
+  static const bool vector = false;
+  static bool defined(long long, long long b) { return b != 0; }
+  static long long apply(long long a, long long b) {
+    return b == -1 ? 0 : a % b;
+  }
+};
+
+struct OpAnd {
+  static const bool vector = true;
+  static bool defined(long long, long long) { return true; }
+  static long long apply(long long a, long long b) { return a & b; }
+  __attribute__((target("avx2")))
+  static __m256i apply(__m256i a, __m256i b) { return _mm256_and_si256(a, b); }
+  __attribute__((target("avx512f,avx512dq")))
+  static __m512i apply(__m512i a, __m512i b) { return _mm512_and_si512(a, b); }
+};
+
+struct OpOr {
+  static const bool vector = true;
+  static bool defined(long long, long long) { return true; }
+  static long long apply(long long a, long long b) { return a | b; }
+  __attribute__((target("avx2")))
+  static __m256i apply(__m256i a, __m256i b) { return _mm256_or_si256(a, b); }
+  __attribute__((target("avx512f,avx512dq")))
+  static __m512i apply(__m512i a, __m512i b) { return _mm512_or_si512(a, b); }
+};
+
+struct OpXor {
+  static const bool vector = true;
+  static bool defined(long long, long long) { return true; }
+  static long long apply(long long a, long long b) { return a ^ b; }
+  __attribute__((target("avx2")))
+  static __m256i apply(__m256i a, __m256i b) { return _mm256_xor_si256(a, b); }
+  __attribute__((target("avx512f,avx512dq")))
+  static __m512i apply(__m512i a, __m512i b) { return _mm512_xor_si512(a, b); }
+};
+
+struct OpNand {
+  static const bool vector = true;
+  static bool defined(long long, long long) { return true; }
+  static long long apply(long long a, long long b) { return ~(a & b); }
+  __attribute__((target("avx2")))
+  static __m256i apply(__m256i a, __m256i b) {
+    return _mm256_xor_si256(_mm256_and_si256(a, b), _mm256_set1_epi64x(-1));
+  }
+  __attribute__((target("avx512f,avx512dq")))
+  static __m512i apply(__m512i a, __m512i b) {
+    return _mm512_xor_si512(_mm512_and_si512(a, b), _mm512_set1_epi64(-1));
+  }
+};
+
+struct OpNor {
+  static const bool vector = true;
+  static bool defined(long long, long long) { return true; }
+  static long long apply(long long a, long long b) { return ~(a | b); }
+  __attribute__((target("avx2")))
+  static __m256i apply(__m256i a, __m256i b) {
+    return _mm256_xor_si256(_mm256_or_si256(a, b), _mm256_set1_epi64x(-1));
+  }
+  __attribute__((target("avx512f,avx512dq")))
+  static __m512i apply(__m512i a, __m512i b) {
+    return _mm512_xor_si512(_mm512_or_si512(a, b), _mm512_set1_epi64(-1));
+  }
+};
+
+/*
+  Power by squaring, wrapping around on overflow. A negative exponent is a
+  division by the power, so it truncates to 0 unless the base is 1 or -1
+  and has no result for 0
+*/
+struct OpPow {
+  static const bool vector = false;
+  static bool defined(long long a, long long b) { return b >= 0 || a != 0; }
+  static long long apply(long long a, long long b) {
+    if (b < 0) return a == 1 ? 1 : a == -1 ? (b & 1 ? -1 : 1) : 0;
+
+    unsigned long long base = a;
+    unsigned long long result = 1;
+    for (unsigned long long exponent = b; exponent > 0; exponent >>= 1) {
+      if (exponent & 1) result *= base;
+      base *= base;
+    }
+    return (long long) result;
+  }
+};
+
+/*
+  Greatest common divisor of the absolute values, 0 for 0 and 0. The one of
+  the smallest number and 0 doesn't fit and wraps around to it
+*/
+struct OpGcd {
+  static const bool vector = false;
+  static bool defined(long long, long long) { return true; }
+  static long long apply(long long a, long long b) {
+    unsigned long long x = a < 0 ? 0 - (unsigned long long) a : a;
+    unsigned long long y = b < 0 ? 0 - (unsigned long long) b : b;
+    while (y != 0) {
+      unsigned long long rest = x % y;
+      x = y;
+      y = rest;
+    }
+    return (long long) x;
+  }
+};
+
+/*
+  Ready items of one service in structure of arrays form, so a whole block
+  is calculated by a single kernel call
+*/
+struct ItemBlock {
+  Service * owner;
+  int count;
+  int sequences[BATCH_SIZE];
+  unsigned int tags[BATCH_SIZE];
+  unsigned short origins[BATCH_SIZE];
+  short pipelines[BATCH_SIZE];
+  unsigned char stages[BATCH_SIZE];
+  unsigned char part[BATCH_SIZE];
+  unsigned char parts[BATCH_SIZE];
+  long long number1[BATCH_SIZE];
+  long long number2[BATCH_SIZE];
+  long long results[BATCH_SIZE];
+  unsigned char defined[BATCH_SIZE];
+};
+
+typedef void (*BatchKernel)(ItemBlock &);
+
+template <typename Op>
+void scalarKernel(ItemBlock & block) {
+
+  for (int i = 0; i < block.count; i++) {
+    block.defined[i] = Op::defined(block.number1[i], block.number2[i]);
+    block.results[i] = block.defined[i] ?
+                       Op::apply(block.number1[i], block.number2[i]) : 0;
+  }
+
+}
+
+template <typename Op>
+__attribute__((target("avx2")))
+void avx2Kernel(ItemBlock & block) {
+
+  int i = 0;
+
+  for (; i + 4 <= block.count; i += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) (block.number1 + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (block.number2 + i));
+    _mm256_storeu_si256((__m256i *) (block.results + i), Op::apply(a, b));
+  }
+  for (; i < block.count; i++) {
+    block.results[i] = Op::apply(block.number1[i], block.number2[i]);
+  }
+  memset(block.defined, 1, block.count);
+
+}
+
+template <typename Op>
+__attribute__((target("avx512f,avx512dq")))
+void avx512Kernel(ItemBlock & block) {
+
+  int i = 0;
+
+  for (; i + 8 <= block.count; i += 8) {
+    __m512i a = _mm512_loadu_si512((const void *) (block.number1 + i));
+    __m512i b = _mm512_loadu_si512((const void *) (block.number2 + i));
+    _mm512_storeu_si512((void *) (block.results + i), Op::apply(a, b));
+  }
+  // The tail goes through a masked load and store
+  if (i < block.count) {
+    __mmask8 mask = (__mmask8) ((1 << (block.count - i)) - 1);
+    __m512i a = _mm512_maskz_loadu_epi64(mask, block.number1 + i);
+    __m512i b = _mm512_maskz_loadu_epi64(mask, block.number2 + i);
+    _mm512_mask_storeu_epi64(block.results + i, mask, Op::apply(a, b));
+  }
+  memset(block.defined, 1, block.count);
+
+}
+
+/* Kernels an operation has, NULL for the vector ones it lacks */
+struct OperationKernels {
+  BatchKernel scalar;
+  BatchKernel avx2;
+  BatchKernel avx512;
+};
+
+template <typename Op, bool vector = Op::vector>
+struct KernelsOf {
+  static constexpr OperationKernels get() {
+    return OperationKernels { scalarKernel<Op>, avx2Kernel<Op>,
+                              avx512Kernel<Op> };
+  }
+};
+
+template <typename Op>
+struct KernelsOf<Op, false> {
+  static constexpr OperationKernels get() {
+    return OperationKernels { scalarKernel<Op>, NULL, NULL };
+  }
+};
+
+/*
+  The operation of every service, in the order of the service numbers. A
+  new operation only needs its number and a line here
+*/
+constexpr OperationKernels operations[] = {
+  KernelsOf<OpSum>::get(),
+  KernelsOf<OpSub>::get(),
+  KernelsOf<OpMult>::get(),
+  KernelsOf<OpDiv>::get(),
+  KernelsOf<OpMod>::get(),
+  KernelsOf<OpAnd>::get(),
+  KernelsOf<OpOr>::get(),
+  KernelsOf<OpXor>::get(),
+  KernelsOf<OpNand>::get(),
+  KernelsOf<OpNor>::get(),
+  KernelsOf<OpPow>::get(),
+  KernelsOf<OpGcd>::get()
+};
+
+static_assert(sizeof(operations) / sizeof(operations[0]) == SERVICES_COUNT,
+              "every service needs an operation");
+
+/* Kernel of every service, chosen once for the processor parsim runs on */
+BatchKernel batchKernels[SERVICES_COUNT];
+
+void selectBatchKernels() {
+
+  __builtin_cpu_init();
+  bool avx512 = __builtin_cpu_supports("avx512f") &&
+                __builtin_cpu_supports("avx512dq");
+  bool avx2 = __builtin_cpu_supports("avx2");
+
+  for (int i = 0; i < SERVICES_COUNT; i++) {
+    const OperationKernels & kernels = operations[i];
+    batchKernels[i] = avx512 && kernels.avx512 != NULL ? kernels.avx512 :
+                      avx2 && kernels.avx2 != NULL ? kernels.avx2 :
+                      kernels.scalar;
+  }
+
+}
+
+struct CacheStats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+};
+
+/*
+  Results already calculated, keyed by service and operands, so a repeated
+  item skips the queue and the delay of its service. A key can only live in
+  one set of CACHE_WAYS entries, and a full set makes room with the CLOCK
+  algorithm: its hand passes over the entries hit since it last came by,
+  clearing their mark, and takes the first one that wasn't. Workers write
+  an entry under a sequence lock, odd while the write is going on, so the
+  FrontEnd never waits to read it; a read that races a write is a miss.
+  Nothing is allocated once it starts.
+*/
+class ResultCache {
+  private:
+    struct Entry {
+      // 0 while empty
+      atomic<unsigned int> version;
+      atomic<bool> referenced;
+      atomic<bool> defined;
+      atomic<int> service;
+      atomic<long long> number1;
+      atomic<long long> number2;
+      atomic<long long> result;
+    };
+    Entry * entries;
+    atomic<unsigned int> * hands;
+    unsigned int sets;
+    atomic<unsigned long> hits;
+    atomic<unsigned long> misses;
+    atomic<unsigned long> evictions;
+    Entry * set(int, long long, long long);
+    bool read(Entry &, int, long long, long long, long long &, bool &);
+  public:
+    void init(int);
+    bool find(int, long long, long long, long long &, bool &);
+    void store(int, long long, long long, long long, bool);
+    CacheStats stats();
+};
+
+/* Room for at least size results, rounded up to a power of two sets */
+void ResultCache::init(int size) {
+
+  sets = 1;
+  while (sets * CACHE_WAYS < (unsigned int) size) sets *= 2;
+
+  entries = new Entry[sets * CACHE_WAYS];
+  hands = new atomic<unsigned int>[sets];
+  for (unsigned int i = 0; i < sets * CACHE_WAYS; i++) {
+    entries[i].version = 0;
+    entries[i].referenced = false;
+  }
+  for (unsigned int i = 0; i < sets; i++) hands[i] = 0;
+  hits = 0;
+  misses = 0;
+  evictions = 0;
+
+}
+
+/* First entry of the set the key belongs to */
+ResultCache::Entry * ResultCache::set(int service, long long number1,
+                                      long long number2) {
+
+  // Operands are mixed with the finalizer of MurmurHash3
+  unsigned long long key = (unsigned long long) number1 ^
+                           (unsigned long long) number2 * 0x9E3779B97F4A7C15ULL
+                           ^ (unsigned long long) service << 56;
+  key ^= key >> 33;
+  key *= 0xFF51AFD7ED558CCDULL;
+  key ^= key >> 33;
+  key *= 0xC4CEB9FE1A85EC53ULL;
+  key ^= key >> 33;
+
+  return entries + (key & (sets - 1)) * CACHE_WAYS;
+
+}
+
+/* Whether entry holds the key, with a result that wasn't being written */
+bool ResultCache::read(Entry & entry, int service, long long number1,
+                       long long number2, long long & result, bool & defined) {
+
+  unsigned int version = entry.version.load(memory_order_acquire);
+  if (version == 0 || version & 1) return false;
+
+  bool found = entry.service.load(memory_order_relaxed) == service &&
+               entry.number1.load(memory_order_relaxed) == number1 &&
+               entry.number2.load(memory_order_relaxed) == number2;
+  result = entry.result.load(memory_order_relaxed);
+  defined = entry.defined.load(memory_order_relaxed);
+
+  atomic_thread_fence(memory_order_acquire);
+  return found && entry.version.load(memory_order_relaxed) == version;
+
+}
+
+bool ResultCache::find(int service, long long number1, long long number2,
+                       long long & result, bool & defined) {
+
+  Entry * ways = set(service, number1, number2);
+
+  for (int i = 0; i < CACHE_WAYS; i++) {
+    if (read(ways[i], service, number1, number2, result, defined)) {
+      if (!ways[i].referenced.load(memory_order_relaxed)) {
+        ways[i].referenced.store(true, memory_order_relaxed);
+      }
+      hits.fetch_add(1, memory_order_relaxed);
+      return true;
+    }
+  }
+
+  misses.fetch_add(1, memory_order_relaxed);
+  return false;
+
+}
+
+/*
+  Keeps a result calculated by a worker. When another worker is writing the
+  chosen entry the result is not kept, a later item will bring it again
+*/
+void ResultCache::store(int service, long long number1, long long number2,
+                        long long result, bool defined) {
+
+  Entry * ways = set(service, number1, number2);
+  atomic<unsigned int> & hand = hands[(ways - entries) / CACHE_WAYS];
+  long long cached;
+  bool cachedDefined;
+
+  for (int i = 0; i < CACHE_WAYS; i++) {
+    if (read(ways[i], service, number1, number2, cached, cachedDefined)) {
+      return;
+    }
+  }
+
+  // Every entry gets a second chance, so two turns always find one
+  Entry * victim = NULL;
+  for (int i = 0; i < 2 * CACHE_WAYS && victim == NULL; i++) {
+    Entry & entry = ways[hand.fetch_add(1, memory_order_relaxed) % CACHE_WAYS];
+
+    if (entry.version.load(memory_order_relaxed) != 0 &&
+        entry.referenced.load(memory_order_relaxed)) {
+      entry.referenced.store(false, memory_order_relaxed);
+    } else {
+      victim = &entry;
+    }
+  }
+  if (victim == NULL) return;
+
+  unsigned int version = victim->version.load(memory_order_relaxed);
+  if (version & 1 || !victim->version.compare_exchange_strong(version,
+                                                              version + 1)) {
+    return;
+  }
+  if (version != 0) evictions.fetch_add(1, memory_order_relaxed);
+
+  atomic_thread_fence(memory_order_release);
+  victim->service.store(service, memory_order_relaxed);
+  victim->number1.store(number1, memory_order_relaxed);
+  victim->number2.store(number2, memory_order_relaxed);
+  victim->result.store(result, memory_order_relaxed);
+  victim->defined.store(defined, memory_order_relaxed);
+  victim->referenced.store(false, memory_order_relaxed);
+  victim->version.store(version + 2, memory_order_release);
+
+}
+
+CacheStats ResultCache::stats() {
+
+  CacheStats stats;
+  stats.hits = hits.load(memory_order_relaxed);
+  stats.misses = misses.load(memory_order_relaxed);
+  stats.evictions = evictions.load(memory_order_relaxed);
+  return stats;
+
+}
+
+class MiddleEnd;
+struct ServiceWorker;
+
+/*
+  Stages of a pipeline: stage s calculates services[s] with the result of
+  the stage before it and operands[s], after waiting delays[s]
+*/
+struct Pipeline {
+  int stages;
+  Service * services[MAX_PIPELINE_STAGES];
+  long long operands[MAX_PIPELINE_STAGES];
+  unsigned int delays[MAX_PIPELINE_STAGES];
+};
+
+/*
+  Pipelines of the messages in flight. The FrontEnd takes one for every
+  pipeline it sends and waits when all of them are in use; the worker that
+  calculates the last stage gives it back
+*/
+class PipelinePool {
+  private:
+    Pipeline * pipelines;
+    RingQueue<int, true, false> available;
+  public:
+    void init(int);
+    int take();
+    Pipeline & get(int);
+    void release(int);
+};
+
+void PipelinePool::init(int size) {
+
+  pipelines = new Pipeline[size];
+  available.init(size);
+  for (int i = 0; i < size; i++) available.push(i);
+
+}
+
+int PipelinePool::take() {
+
+  int index;
+  available.pop(index);
+  return index;
+
+}
+
+Pipeline & PipelinePool::get(int index) {
+  return pipelines[index];
+}
+
+void PipelinePool::release(int index) {
+  available.push(index);
+}
+
+/* Bounds of a service given -e; the lower ones are what it started with */
+struct ScaleLimits {
+  int minSize;
+  int maxSize;
+  int minWorkers;
+  int maxWorkers;
+};
+
+/* How often the queue of a service was full, by what was done about it */
+struct OverflowStats {
+  unsigned long blocked;
+  unsigned long rejected;
+  unsigned long dropped;
+  unsigned long spilled;
+  unsigned long spillDepth;
+};
+
+/*
+  Items wait in a queue per priority. Workers take from the most urgent one
+  first, so an interactive item doesn't wait behind the batch items that
+  arrived before it, and sleep on the doorbell, which every queued item
+  rings, when they are all empty
+*/
+class Service {
+  private:
+    // The FrontEnd is the only producer, every worker of the service consumes
+    RingQueue<BufferInMiddleEnd, false, true> itemsMiddleEnd[PRIORITIES];
+    alignas(CACHE_LINE_SIZE) atomic<int> doorbell;
+    atomic<int> sleepers;
+    atomic<long long> consumerBlocked;
+    // Items that didn't fit in the queue with the spill policy
+    RingQueue<BufferInMiddleEnd, false, false> spilledItems;
+    // Spilled items the replay thread hasn't queued yet
+    atomic<unsigned long> unreplayed;
+    // Items the FrontEnd handed over, with -L, for the lane thread to produce
+    RingQueue<BufferInMiddleEnd, false, false> lane;
+    int laneSize;
+    // Where the results are kept with -R, NULL without it
+    ResultCache * cache;
+    PipelinePool * pipelines;
+    int overflowPolicy;
+    int spillSize;
+    atomic<unsigned long> blocked;
+    atomic<unsigned long> rejected;
+    atomic<unsigned long> dropped;
+    atomic<unsigned long> spilled;
+    BackEnd * backEnd;
+    atomic<bool> status;
+    int type;
+    int bufferSize;
+    // With -e the Autoscaler moves the queue size and active workers in here
+    int maxSize;
+    int minWorkers;
+    int maxWorkers;
+    atomic<int> activeWorkers;
+    vector<pid_t> workers;
+    atomic<unsigned long> processed;
+    atomic<unsigned long> errors;
+    bool queue(BufferInMiddleEnd &);
+    void ring();
+    void closeQueues();
+  public:
+    Service();
+    ~Service();
+    bool getStatus();
+    int getBufferSize();
+    QueueStats getQueueStats();
+    unsigned long getDepth(int);
+    unsigned long getHighWater(int);
+    unsigned long getDeepest();
+    unsigned long getProcessed();
+    unsigned long getErrors();
+    OverflowStats getOverflowStats();
+    int getSpillSize();
+    void setOverflowPolicy(int, int);
+    void setCache(ResultCache *);
+    void setPipelines(PipelinePool *);
+    void setLimits(int, int);
+    ScaleLimits getLimits();
+    bool isElastic();
+    unsigned long getCapacity();
+    void resize(unsigned long);
+    int getActiveWorkers();
+    void setActiveWorkers(int);
+    void start(int, int, int, BackEnd *);
+    void addWorker(pid_t);
+    void produce(BufferInMiddleEnd);
+    void dispatch(BufferInMiddleEnd &);
+    void startLane(int);
+    QueueStats getLaneStats();
+    static int feed(void *);
+    void turnAway(BufferInMiddleEnd &, int);
+    static int replay(void *);
+    void closeQueue();
+    bool drained();
+    bool take(BufferInMiddleEnd &, unsigned int &);
+    bool takeUntil(BufferInMiddleEnd &, unsigned int &, long long);
+    bool steal(BufferInMiddleEnd &, unsigned int &);
+    void close();
+    void stop();
+    static int consume (void *);
+    static void addReady(ServiceWorker *, Service *, BufferInMiddleEnd &);
+    static void hold(ServiceWorker *, Service *, BufferInMiddleEnd &);
+    void produceBackEnd(ServiceWorker *);
+};
+
+/*
+  State owned by one consumer thread of a service. Only the workers whose
+  index is below the active count of the service take new items
+*/
+struct ServiceWorker {
+  int index;
+  // Items taken so far, which decides when the less urgent queues get one
+  unsigned int turn;
+  Service * service;
+  MiddleEnd * middleEnd;
+  DelayHeap delayedItems;
+  ItemBlock ready;
+};
+
+Service::Service() {
+  status = false;
+  overflowPolicy = OVERFLOW_BLOCK;
+  spillSize = 0;
+  laneSize = 0;
+  cache = NULL;
+  pipelines = NULL;
+  maxSize = 0;
+  maxWorkers = 0;
+}
+
+void Service::setCache(ResultCache * cache) {
+  this->cache = cache;
+}
+
+void Service::setPipelines(PipelinePool * pipelines) {
+  this->pipelines = pipelines;
+}
+
+Service::~Service() {
+    status = false;
+}
+
+bool Service::getStatus() {
+  return status.load(memory_order_acquire);
+}
+
+int Service::getBufferSize() {
+  return bufferSize;
+}
+
+/*
+  The counters of every priority added up, but the high water mark, which
+  is the one of the fullest queue. Consumers are blocked on the doorbell
+*/
+QueueStats Service::getQueueStats() {
+
+  QueueStats total;
+  memset(&total, 0, sizeof(total));
+
+  for (int i = 0; i < PRIORITIES; i++) {
+    QueueStats stats = itemsMiddleEnd[i].stats();
+    total.enqueued += stats.enqueued;
+    total.dequeued += stats.dequeued;
+    total.depth += stats.depth;
+    total.highWater = max(total.highWater, stats.highWater);
+    total.producerBlocked += stats.producerBlocked;
+  }
+  total.consumerBlocked = consumerBlocked.load(memory_order_relaxed);
+
+  return total;
+
+}
+
+/* Items waiting with the given priority */
+unsigned long Service::getDepth(int priority) {
+  return itemsMiddleEnd[priority].size();
+}
+
+/* Most items that waited at once with the given priority */
+unsigned long Service::getHighWater(int priority) {
+  return itemsMiddleEnd[priority].stats().highWater;
+}
+
+/* Items in the fullest queue, each of them has the whole capacity */
+unsigned long Service::getDeepest() {
+
+  unsigned long deepest = 0;
+  for (int i = 0; i < PRIORITIES; i++) {
+    deepest = max(deepest, itemsMiddleEnd[i].size());
+  }
+  return deepest;
+
+}
+
+/* Items calculated by any worker, including the ones stolen from here */
+unsigned long Service::getProcessed() {
+  return processed.load(memory_order_relaxed);
+}
+
+/* Items that had no result, like a division by zero */
+unsigned long Service::getErrors() {
+  return errors.load(memory_order_relaxed);
+}
+
+OverflowStats Service::getOverflowStats() {
+
+  OverflowStats stats;
+  stats.blocked = blocked.load(memory_order_relaxed);
+  stats.rejected = rejected.load(memory_order_relaxed);
+  stats.dropped = dropped.load(memory_order_relaxed);
+  stats.spilled = spilled.load(memory_order_relaxed);
+  stats.spillDepth = overflowPolicy == OVERFLOW_SPILL ? spilledItems.size() : 0;
+  return stats;
+
+}
+
+/* Items the spill buffer holds, 0 with any other policy */
+int Service::getSpillSize() {
+  return overflowPolicy == OVERFLOW_SPILL ? spillSize : 0;
+}
+
+/* Must be set before the service starts */
+void Service::setOverflowPolicy(int policy, int spillSize) {
+  overflowPolicy = policy;
+  this->spillSize = spillSize;
+}
+
+/*
+  -e: the queue may grow up to maxSize items and up to maxWorkers may work.
+  Must be set before the service starts
+*/
+void Service::setLimits(int maxSize, int maxWorkers) {
+  this->maxSize = maxSize;
+  this->maxWorkers = maxWorkers;
+}
+
+ScaleLimits Service::getLimits() {
+
+  ScaleLimits limits;
+  limits.minSize = bufferSize;
+  limits.maxSize = maxSize;
+  limits.minWorkers = minWorkers;
+  limits.maxWorkers = maxWorkers;
+  return limits;
+
+}
+
+bool Service::isElastic() {
+  return maxSize > bufferSize || maxWorkers > minWorkers;
+}
+
+/* Items each priority may have queued */
+unsigned long Service::getCapacity() {
+  return itemsMiddleEnd[0].getCapacity();
+}
+
+/* Items already queued beyond a smaller size are still consumed */
+void Service::resize(unsigned long capacity) {
+  for (int i = 0; i < PRIORITIES; i++) itemsMiddleEnd[i].resize(capacity);
+}
+
+int Service::getActiveWorkers() {
+  return activeWorkers.load(memory_order_relaxed);
+}
+
+/*
+  Workers beyond count finish the items they hold and wait; the ones below
+  it that were waiting go back to work
+*/
+void Service::setActiveWorkers(int count) {
+  activeWorkers.store(count);
+  futexWake(&activeWorkers, INT_MAX);
+}
+
+/* Starts with bufferSize items of queue and workers active workers */
+void Service::start(int type, int bufferSize, int workers, BackEnd * backEnd){
+
+  this->type = type;
+  this->bufferSize = bufferSize;
+  this->backEnd = backEnd;
+  maxSize = max(maxSize, bufferSize);
+  minWorkers = workers;
+  maxWorkers = max(maxWorkers, workers);
+  activeWorkers = workers;
+
+  for (int i = 0; i < PRIORITIES; i++) {
+    itemsMiddleEnd[i].init(bufferSize, maxSize);
+  }
+  doorbell = 0;
+  sleepers = 0;
+  consumerBlocked = 0;
+  if (overflowPolicy == OVERFLOW_SPILL) spilledItems.init(spillSize);
+  unreplayed = 0;
+  processed = 0;
+  errors = 0;
+  blocked = 0;
+  rejected = 0;
+  dropped = 0;
+  spilled = 0;
+  status.store(true, memory_order_release);
+
+}
+
+/*
+  Queues an item for the workers. When the queue of its priority is full the
+  FrontEnd waits (block), turns the item away (reject), makes room by turning
+  away the oldest item of that queue (drop-oldest), or keeps it in the spill
+  buffer, which the replay thread moves into the queue as room appears
+  (spill)
+*/
+void Service::produce(BufferInMiddleEnd item) {
+
+  RingQueue<BufferInMiddleEnd, false, true> & items =
+    itemsMiddleEnd[item.priority];
+  BufferInMiddleEnd oldest;
+
+  switch (overflowPolicy) {
+    case OVERFLOW_REJECT:
+      if (!queue(item)) {
+        rejected.fetch_add(1, memory_order_relaxed);
+        turnAway(item, ITEM_REJECTED);
+      }
+      break;
+    case OVERFLOW_DROP:
+      while (!queue(item)) {
+        if (items.tryPop(oldest)) {
+          dropped.fetch_add(1, memory_order_relaxed);
+          turnAway(oldest, ITEM_DROPPED);
+        }
+      }
+      break;
+    case OVERFLOW_SPILL:
+      /*
+        Once items are spilled the next ones go behind them, until the
+        replay thread queued the last one: the queues have a single
+        producer, so only one of the two may push at a time
+      */
+      if (unreplayed.load() > 0 || !queue(item)) {
+        spilled.fetch_add(1, memory_order_relaxed);
+        unreplayed.fetch_add(1);
+        spilledItems.push(item);
+      }
+      break;
+    default:
+      if (!queue(item)) {
+        blocked.fetch_add(1, memory_order_relaxed);
+        items.push(item);
+        ring();
+      }
+  }
+
+}
+
+/* Queues an item by its priority if there is room, ringing the doorbell */
+bool Service::queue(BufferInMiddleEnd & item) {
+
+  if (!itemsMiddleEnd[item.priority].tryPush(item)) return false;
+  ring();
+  return true;
+
+}
+
+/*
+  Tells the sleeping workers something changed. Like the futex words of a
+  ring, the doorbell is bumped before the sleepers are counted, so a worker
+  about to sleep either sees the new value or gets woken
+*/
+void Service::ring() {
+
+  doorbell.fetch_add(1);
+  if (sleepers.load() > 0) {
+    futexWake(&doorbell, 1);
+  }
+
+}
+
+/*
+  Where the FrontEnd sends the items of the service. With a lane it only
+  waits when the lane itself is full, whatever the state of the queue
+*/
+void Service::dispatch(BufferInMiddleEnd & item) {
+  if (laneSize > 0) {
+    lane.push(item);
+  } else {
+    produce(item);
+  }
+}
+
+/* Gives the service a lane of size items and the thread that empties it */
+void Service::startLane(int size) {
+  laneSize = size;
+  lane.init(size);
+  addWorker(spawnThread(&Service::feed, this));
+}
+
+QueueStats Service::getLaneStats() {
+
+  if (laneSize > 0) return lane.stats();
+
+  QueueStats stats;
+  memset(&stats, 0, sizeof(stats));
+  return stats;
+
+}
+
+/* Produces the items of the lane in order, then closes the queue */
+int Service::feed(void * arg) {
+
+  Service * service = (Service*) arg;
+  BufferInMiddleEnd item;
+
+  while (service->lane.pop(item)) {
+    service->produce(item);
+  }
+  service->closeQueue();
+
+  return 0;
+
+}
+
+/* Reports to the BackEnd an item that won't be calculated */
+void Service::turnAway(BufferInMiddleEnd & item, int status) {
+
+  if (item.pipeline >= 0) pipelines->release(item.pipeline);
+
+  BufferInBackEnd result;
+  result.sequence = item.sequence;
+  result.tag = item.tag;
+  result.origin = item.origin;
+  result.part = item.part;
+  result.parts = item.parts;
+  result.service = type;
+  result.status = status;
+  result.result = 0;
+  backEnd->produce(result);
+
+}
+
+/* Moves spilled items into the queue, then closes it once input is over */
+int Service::replay(void * arg) {
+
+  Service * service = (Service*) arg;
+  BufferInMiddleEnd item;
+
+  while (service->spilledItems.pop(item)) {
+    service->itemsMiddleEnd[item.priority].push(item);
+    service->ring();
+    service->unreplayed.fetch_sub(1);
+  }
+  service->closeQueues();
+
+  return 0;
+
+}
+
+void Service::addWorker(pid_t worker) {
+  workers.push_back(worker);
+}
+
+/*
+  Tells the service that the FrontEnd won't send anything else. Every worker
+  helps to finish what is left
+*/
+void Service::close() {
+  setActiveWorkers(maxWorkers);
+  if (laneSize > 0) {
+    lane.close();
+  } else {
+    closeQueue();
+  }
+}
+
+/*
+  Tells the workers that nothing else will be produced. With spill the replay
+  thread closes the queue once the spilled items are in
+*/
+void Service::closeQueue() {
+  if (overflowPolicy == OVERFLOW_SPILL) {
+    spilledItems.close();
+  } else {
+    closeQueues();
+  }
+}
+
+/* Closes the queue of every priority and wakes every sleeping worker */
+void Service::closeQueues() {
+
+  for (int i = 0; i < PRIORITIES; i++) itemsMiddleEnd[i].close();
+  doorbell.fetch_add(1);
+  futexWake(&doorbell, INT_MAX);
+
+}
+
+/* Whether the input is over and every queue is empty */
+bool Service::drained() {
+
+  for (int i = 0; i < PRIORITIES; i++) {
+    if (!itemsMiddleEnd[i].drained()) return false;
+  }
+  return true;
+
+}
+
+/*
+  Takes the next item, from the most urgent queue that has one. turn counts
+  the items its taker took: every PRIORITY_STREAK-th take starts one queue
+  lower, every PRIORITY_STREAK^2-th two lower and so on, so while the urgent
+  queues never empty the others still get a share and don't starve
+*/
+bool Service::take(BufferInMiddleEnd & item, unsigned int & turn) {
+
+  int first = 0;
+  for (unsigned int t = ++turn; first < PRIORITIES - 1 &&
+       t % PRIORITY_STREAK == 0; t /= PRIORITY_STREAK) {
+    first++;
+  }
+
+  for (int i = 0; i < PRIORITIES; i++) {
+    int priority = PRIORITIES - 1 - (first + i) % PRIORITIES;
+    if (itemsMiddleEnd[priority].tryPop(item)) return true;
+  }
+
+  return false;
+
+}
+
+/*
+  Same as take but waits on the doorbell for an item until the deadline.
+  Returns whether an item came
+*/
+bool Service::takeUntil(BufferInMiddleEnd & item, unsigned int & turn,
+                        long long deadline) {
+
+  bool taken = false;
+  long long blockedSince = monotonicNow();
+
+  sleepers.fetch_add(1);
+  while (true) {
+    int observed = doorbell.load();
+    if (take(item, turn)) {
+      taken = true;
+      break;
+    }
+    if (drained() || monotonicNow() >= deadline) break;
+    futexWait(&doorbell, observed, deadline);
+  }
+  sleepers.fetch_sub(1);
+
+  consumerBlocked.fetch_add(monotonicNow() - blockedSince,
+                            memory_order_relaxed);
+
+  return taken;
+
+}
+
+/* Waits for the workers to finish every item already produced */
+void Service::stop() {
+
+  close();
+
+  for (size_t i = 0; i < workers.size(); i++) {
+    joinThread(workers[i]);
+  }
+
+}
+
+/* Lets a worker of another service take an item queued here */
+bool Service::steal(BufferInMiddleEnd & item, unsigned int & turn) {
+  return take(item, turn);
+}
+
+/*
+  Keeps an item a worker took from a queue of owner. Items without delay go
+  to the block right away, whichever way they were taken, so they are
+  calculated in the order they were queued
+*/
+void Service::hold(ServiceWorker * worker, Service * owner,
+                   BufferInMiddleEnd & item) {
+
+  if (item.delay == 0) {
+    addReady(worker, owner, item);
+  } else {
+    worker->delayedItems.park(item, monotonicNow() + item.delay * 1000000LL,
+                              owner);
+  }
+
+}
+
+/*
+  Queues an item whose delay is over in the worker's block. The block is
+  calculated first when it is full or holds items of another service
+*/
+void Service::addReady(ServiceWorker * worker, Service * owner,
+                       BufferInMiddleEnd & item) {
+
+  ItemBlock & block = worker->ready;
+
+  if (block.count > 0 && (block.owner != owner || block.count == BATCH_SIZE)) {
+    block.owner->produceBackEnd(worker);
+  }
+
+  block.owner = owner;
+  block.sequences[block.count] = item.sequence;
+  block.tags[block.count] = item.tag;
+  block.origins[block.count] = item.origin;
+  block.pipelines[block.count] = item.pipeline;
+  block.stages[block.count] = item.stage;
+  block.part[block.count] = item.part;
+  block.parts[block.count] = item.parts;
+  block.number1[block.count] = item.number1;
+  block.number2[block.count] = item.number2;
+  block.count++;
+
+}
+
+/* Calculates a block of items and produces the results in the BackEnd */
+void Service::produceBackEnd(ServiceWorker * worker) {
+
+  ItemBlock & block = worker->ready;
+  int undefined = 0;
+
+  batchKernels[type](block);
+
+  for (int i = 0; cache != NULL && i < block.count; i++) {
+    cache->store(type, block.number1[i], block.number2[i], block.results[i],
+                 block.defined[i]);
+  }
+
+  for (int i = 0; i < block.count; i++) {
+
+    /*
+      The result of a pipeline stage waits for the next one in the heap of
+      the same worker, which has room for the whole block
+    */
+    if (block.pipelines[i] >= 0) {
+      Pipeline & pipeline = pipelines->get(block.pipelines[i]);
+      int stage = block.stages[i] + 1;
+
+      if (block.defined[i] && stage < pipeline.stages) {
+        BufferInMiddleEnd next;
+        next.sequence = block.sequences[i];
+        next.tag = block.tags[i];
+        next.origin = block.origins[i];
+        next.part = block.part[i];
+        next.parts = block.parts[i];
+        next.pipeline = block.pipelines[i];
+        next.stage = stage;
+        next.number1 = block.results[i];
+        next.number2 = pipeline.operands[stage];
+        next.delay = pipeline.delays[stage];
+        // Parked right away, it doesn't wait in a queue again
+        next.priority = 0;
+        worker->delayedItems.park(next, monotonicNow() +
+                                  next.delay * 1000000LL,
+                                  pipeline.services[stage]);
+        continue;
+      }
+      pipelines->release(block.pipelines[i]);
+    }
+
+    BufferInBackEnd item;
+    item.sequence = block.sequences[i];
+    item.tag = block.tags[i];
+    item.origin = block.origins[i];
+    item.part = block.part[i];
+    item.parts = block.parts[i];
+    item.service = type;
+    item.status = block.defined[i] ? ITEM_OK : ITEM_DIVISION_BY_ZERO;
+    item.result = block.results[i];
+    backEnd->produce(item);
+    if (!block.defined[i]) undefined++;
+  }
+
+  processed.fetch_add(block.count, memory_order_relaxed);
+  if (undefined > 0) errors.fetch_add(undefined, memory_order_relaxed);
+  block.count = 0;
+
+}
+
+class MiddleEnd{
+  private:
+    Service services[SERVICES_COUNT];
+    int itemsCapacity;
+    bool caching;
+    ResultCache cache;
+    PipelinePool pipelines;
+  public:
+    MiddleEnd();
+    Service * getService (int);
+    ResultCache * getCache();
+    PipelinePool * getPipelines();
+    int getItemsCapacity();
+    bool stealWork (ServiceWorker *, BufferInMiddleEnd &, Service **);
+    void startService (int, int, int, BackEnd *, const cpu_set_t *);
+    void startLanes (int);
+    void startCache (int);
+    void stop ();
+};
+
+MiddleEnd::MiddleEnd() {
+  itemsCapacity = 0;
+  caching = false;
+  pipelines.init(PIPELINES);
+}
+
+PipelinePool * MiddleEnd::getPipelines() {
+  return &pipelines;
+}
+
+/* The result cache, NULL when there is none */
+ResultCache * MiddleEnd::getCache() {
+  return caching ? &cache : NULL;
+}
+
+/* How many items the queues, delay heaps and ready blocks hold at most */
+int MiddleEnd::getItemsCapacity() {
+  return itemsCapacity;
+}
+
+Service * MiddleEnd::getService(int service) {
+  return &services[service];
+}
+
+/*
+  Takes an item from any other started service that has work queued. The
+  service the item belongs to is returned through victim
+*/
+bool MiddleEnd::stealWork (ServiceWorker * thief, BufferInMiddleEnd & item,
+                           Service ** victim) {
+
+  for (int i = SUM; i < SERVICES_COUNT; i++) {
+    Service * service = getService(i);
+
+    if (service != thief->service && service->getStatus() &&
+        service->steal(item, thief->turn)) {
+      *victim = service;
+      return true;
+    }
+  }
+
+  return false;
+
+}
+
+/* Workers run on cpus when it isn't NULL */
+void MiddleEnd::startService (int type, int bufferSize, int workers,
+                              BackEnd * backEnd, const cpu_set_t * cpus) {
+
+  Service * service = getService(type);
+
+  //Going to create the thread consumers for an specific service
+  service->setPipelines(&pipelines);
+  service->start(type, bufferSize, workers, backEnd);
+  ScaleLimits limits = service->getLimits();
+  itemsCapacity += bufferSize * PRIORITIES + workers *
+                   (bufferSize + BATCH_SIZE) + service->getSpillSize();
+
+  if (service->getSpillSize() > 0) {
+    service->addWorker(spawnThread(&Service::replay, service, cpus));
+  }
+
+  /*
+    The workers -e may need are all created now, as only main creates
+    threads; those beyond workers wait until the Autoscaler wakes them
+  */
+  for (int i = 0; i < limits.maxWorkers; i++) {
+    ServiceWorker * worker = new ServiceWorker;
+    worker->index = i;
+    worker->turn = 0;
+    worker->service = service;
+    worker->middleEnd = this;
+    worker->delayedItems.init(bufferSize);
+    worker->ready.count = 0;
+    service->addWorker(spawnThread(&Service::consume, worker, cpus));
+  }
+
+}
+
+/* Every started service gets a dispatch lane of size items */
+void MiddleEnd::startLanes (int size) {
+
+  for (int i = SUM; i < SERVICES_COUNT; i++) {
+    Service * service = getService(i);
+
+    if (service->getStatus()) {
+      service->startLane(size);
+      itemsCapacity += size;
+    }
+  }
+
+}
+
+/* Every service keeps its results in a cache of size entries */
+void MiddleEnd::startCache (int size) {
+
+  cache.init(size);
+  caching = true;
+
+  for (int i = SUM; i < SERVICES_COUNT; i++) getService(i)->setCache(&cache);
+
+}
+
+void MiddleEnd::stop () {
+
+  /*
+    Close every queue before waiting, so workers that steal don't keep
+    waiting for work from services that are not stopped yet
+  */
+  for (int i = SUM; i < SERVICES_COUNT; i++) {
+    if (getService(i)->getStatus()) getService(i)->close();
+  }
+
+  for (int i = SUM; i < SERVICES_COUNT; i++) {
+    if (getService(i)->getStatus()) getService(i)->stop();
+  }
+
+}
+
+/*
+  Items are taken off the queue as soon as they arrive and parked in the
+  worker's delay heap, so the FrontEnd never waits for a delay to expire and
+  up to bufferSize items can be delayed at the same time by each worker. The
+  thread sleeps until either a new item arrives or the earliest parked item
+  is due. A worker with nothing to do takes queued items from other services
+  and runs them on their behalf. A worker the Autoscaler retired takes
+  nothing new: it finishes the items it holds and waits to be needed again.
+*/
+int Service::consume (void * arg) {
+
+  //Get the reference of the worker and its service
+  ServiceWorker * worker = (ServiceWorker*) arg;
+  Service * service = worker->service;
+  DelayHeap & delayed = worker->delayedItems;
+  BufferInMiddleEnd item;
+  Service * owner;
+
+  while(true){
+
+    int activeWorkers = service->activeWorkers.load();
+    bool active = worker->index < activeWorkers;
+
+    /*
+      Park everything already queued while there is room for it. Items
+      without delay are ready right away
+    */
+    while (active && !delayed.full(worker->ready.count) &&
+           service->take(item, worker->turn)) {
+      hold(worker, service, item);
+    }
+
+    // Calculate the items whose delay has expired
+    long long now = monotonicNow();
+    while (!delayed.empty() && delayed.nextDue() <= now) {
+      owner = delayed.release(item);
+      addReady(worker, owner, item);
+    }
+    if (worker->ready.count > 0) {
+      worker->ready.owner->produceBackEnd(worker);
+    }
+
+    if (active && !delayed.full(worker->ready.count) &&
+        worker->middleEnd->stealWork(worker, item, &owner)) {
+      hold(worker, owner, item);
+      continue;
+    }
+
+    // Once the input is over, leave when nothing is left to do
+    if (delayed.empty() && service->drained()) {
+      break;
+    }
+
+    // Retired: sleep until the next parked item is due or work comes back
+    if (!active) {
+      futexWait(&service->activeWorkers, activeWorkers,
+                delayed.empty() ? 0 : delayed.nextDue());
+      continue;
+    }
+
+    /*
+      Sleep on the own queue. While idle, wake up from time to time to look
+      for work in the other services
+    */
+    long long wakeUp = monotonicNow() + STEAL_INTERVAL_MS * 1000000LL;
+
+    if (delayed.full() || service->drained()) {
+      timespec due = toTimespec(delayed.nextDue());
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+    } else {
+      if (!delayed.empty() && delayed.nextDue() < wakeUp) {
+        wakeUp = delayed.nextDue();
+      }
+      if (service->takeUntil(item, worker->turn, wakeUp)) {
+        hold(worker, service, item);
+      }
+    }
+  }
+
+  return 0;
+
+}
+
+// Raised by SIGUSR1 to ask the metrics thread for a report
+atomic<int> metricsRequests(0);
+
+static void requestMetrics(int) {
+  metricsRequests.fetch_add(1);
+  futexWake(&metricsRequests, 1);
+}
+
+/*
+  Reports the counters of every queue and service. A report is written every
+  interval milliseconds when -m is given, whenever parsim receives SIGUSR1,
+  and once more when parsim finishes if reports are periodic
+*/
+class Metrics {
+  private:
+    MiddleEnd * middleEnd;
+    BackEnd * backEnd;
+    int fd;
+    long long interval;
+    pid_t thread;
+    atomic<bool> stopping;
+    void report();
+    int formatQueue(char *, int, QueueStats);
+  public:
+    Metrics();
+    bool setInterval(long long);
+    bool setFile(string &);
+    int getFd();
+    void start(MiddleEnd *, BackEnd *);
+    void stop();
+    static int run(void *);
+};
+
+Metrics::Metrics() {
+  fd = STDERR_FILENO;
+  interval = 0;
+  thread = 0;
+  stopping = false;
+}
+
+bool Metrics::setInterval(long long milliseconds) {
+  interval = milliseconds * 1000000LL;
+  return milliseconds >= 0;
+}
+
+bool Metrics::setFile(string & path) {
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  return fd >= 0;
+}
+
+/* Where the reports go */
+int Metrics::getFd() {
+  return fd;
+}
+
+void Metrics::start(MiddleEnd * middleEnd, BackEnd * backEnd) {
+
+  this->middleEnd = middleEnd;
+  this->backEnd = backEnd;
+
+  /*
+    Restart the system calls SIGUSR1 interrupts, so the FrontEnd doesn't take
+    an interrupted read for the end of the input
+  */
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = requestMetrics;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &action, NULL);
+
+  thread = spawnThread(Metrics::run, this);
+
+}
+
+void Metrics::stop() {
+
+  stopping = true;
+  metricsRequests.fetch_add(1);
+  futexWake(&metricsRequests, 1);
+  joinThread(thread);
+
+  if (interval > 0) {
+    report();
+  }
+
+}
+
+int Metrics::formatQueue(char * out, int size, QueueStats stats) {
+  return snprintf(out, size, "enqueued=%lu dequeued=%lu depth=%lu "
+                  "high_water=%lu producer_blocked_ms=%.3f "
+                  "consumer_blocked_ms=%.3f", stats.enqueued, stats.dequeued,
+                  stats.depth, stats.highWater, stats.producerBlocked / 1e6,
+                  stats.consumerBlocked / 1e6);
+}
+
+/* One line per service queue and one for the backend queue */
+void Metrics::report() {
+
+  char line[512];
+  int length = snprintf(line, sizeof(line), "metrics time_ms=%lld\n",
+                        monotonicNow() / 1000000LL);
+  ::write(fd, line, length);
+
+  for (int i = SUM; i < SERVICES_COUNT; i++) {
+    Service * service = middleEnd->getService(i);
+    if (!service->getStatus()) continue;
+
+    length = snprintf(line, sizeof(line), "service=%d ", i);
+    length += formatQueue(line + length, sizeof(line) - length,
+                          service->getQueueStats());
+    OverflowStats overflow = service->getOverflowStats();
+    QueueStats lane = service->getLaneStats();
+    length += snprintf(line + length, sizeof(line) - length,
+                       " processed=%lu errors=%lu blocked=%lu rejected=%lu "
+                       "dropped=%lu spilled=%lu spill_depth=%lu lane_depth=%lu "
+                       "lane_blocked_ms=%.3f priority_depth=",
+                       service->getProcessed(), service->getErrors(),
+                       overflow.blocked, overflow.rejected, overflow.dropped,
+                       overflow.spilled, overflow.spillDepth, lane.depth,
+                       lane.producerBlocked / 1e6);
+    for (int priority = 0; priority < PRIORITIES; priority++) {
+      length += snprintf(line + length, sizeof(line) - length, "%s%lu",
+                         priority > 0 ? "/" : "", service->getDepth(priority));
+    }
+    length += snprintf(line + length, sizeof(line) - length,
+                       " priority_high_water=");
+    for (int priority = 0; priority < PRIORITIES; priority++) {
+      length += snprintf(line + length, sizeof(line) - length, "%s%lu",
+                         priority > 0 ? "/" : "",
+                         service->getHighWater(priority));
+    }
+    line[length++] = '\n';
+    ::write(fd, line, length);
+  }
+
+  ResultCache * cache = middleEnd->getCache();
+  if (cache != NULL) {
+    CacheStats stats = cache->stats();
+    length = snprintf(line, sizeof(line),
+                      "cache hits=%lu misses=%lu evictions=%lu\n",
+                      stats.hits, stats.misses, stats.evictions);
+    ::write(fd, line, length);
+  }
+
+  length = snprintf(line, sizeof(line), "backend ");
+  length += formatQueue(line + length, sizeof(line) - length,
+                        backEnd->getQueueStats());
+  line[length++] = '\n';
+  ::write(fd, line, length);
+
+}
+
+int Metrics::run(void * arg) {
+
+  Metrics * metrics = (Metrics*) arg;
+  long long next = monotonicNow() + metrics->interval;
+
+  while (!metrics->stopping) {
+    int observed = metricsRequests.load();
+    futexWait(&metricsRequests, observed, metrics->interval > 0 ? next : 0);
+    if (metrics->stopping) break;
+
+    if (metricsRequests.load() != observed) {
+      metrics->report();
+    } else if (metrics->interval > 0 && monotonicNow() >= next) {
+      metrics->report();
+      next += metrics->interval;
+    }
+  }
+
+  return 0;
+
+}
+
+/* What the Autoscaler saw of a service the last time it looked */
+struct ScaleState {
+  long long producerBlocked;
+  long long consumerBlocked;
+  unsigned long turnedAway;
+  int calm;
+};
+
+/*
+  Scales the services given -e, looking at them every SCALE_INTERVAL_MS
+  milliseconds. A service whose producer waited for room, whose fullest
+  queue is three quarters full or whose items were turned away gets twice
+  the queue and one more worker. One that stayed quiet, its queues under a
+  quarter full, for SCALE_CALM_INTERVALS looks in a row gets half the queue,
+  and one worker less if its workers waited for items half the time. Every
+  decision is written where the metrics go
+*/
+class Autoscaler {
+  private:
+    MiddleEnd * middleEnd;
+    int fd;
+    pid_t thread;
+    atomic<int> stopping;
+    ScaleState states[SERVICES_COUNT];
+    void look(int, long long);
+  public:
+    Autoscaler();
+    void start(MiddleEnd *, int);
+    void stop();
+    static int run(void *);
+};
+
+Autoscaler::Autoscaler() {
+  thread = 0;
+  stopping = 0;
+  memset(states, 0, sizeof(states));
+}
+
+/* Only starts a thread when some service is elastic */
+void Autoscaler::start(MiddleEnd * middleEnd, int fd) {
+
+  this->middleEnd = middleEnd;
+  this->fd = fd;
+
+  for (int i = SUM; i < SERVICES_COUNT; i++) {
+    Service * service = middleEnd->getService(i);
+
+    if (service->getStatus() && service->isElastic()) {
+      thread = spawnThread(Autoscaler::run, this);
+      return;
+    }
+  }
+
+}
+
+/* Stops scaling, so the services can be stopped */
+void Autoscaler::stop() {
+
+  if (thread == 0) return;
+
+  stopping = 1;
+  futexWake(&stopping, 1);
+  joinThread(thread);
+
+}
+
+/* Decides on service from what changed in the last interval nanoseconds */
+void Autoscaler::look(int type, long long interval) {
+
+  Service * service = middleEnd->getService(type);
+  ScaleState & state = states[type];
+  ScaleLimits limits = service->getLimits();
+  QueueStats queue = service->getQueueStats();
+  OverflowStats overflow = service->getOverflowStats();
+
+  long long producerWait = queue.producerBlocked - state.producerBlocked;
+  long long consumerWait = queue.consumerBlocked - state.consumerBlocked;
+  unsigned long turnedAway = overflow.rejected + overflow.dropped +
+                             overflow.spilled;
+  unsigned long capacity = service->getCapacity();
+  unsigned long depth = service->getDeepest();
+  int workers = service->getActiveWorkers();
+
+  bool busy = producerWait > interval / 10 || depth * 4 >= capacity * 3 ||
+              turnedAway > state.turnedAway;
+  bool quiet = !busy && depth * 4 < capacity;
+
+  state.calm = quiet ? state.calm + 1 : 0;
+  state.producerBlocked = queue.producerBlocked;
+  state.consumerBlocked = queue.consumerBlocked;
+  state.turnedAway = turnedAway;
+
+  unsigned long newCapacity = capacity;
+  int newWorkers = workers;
+  const char * reason;
+
+  if (busy) {
+    newCapacity = min(capacity * 2, (unsigned long) limits.maxSize);
+    newWorkers = min(workers + 1, limits.maxWorkers);
+    reason = "busy";
+  } else if (state.calm >= SCALE_CALM_INTERVALS) {
+    state.calm = 0;
+    newCapacity = max(capacity / 2, (unsigned long) limits.minSize);
+    if (consumerWait * 2 >= interval * workers) {
+      newWorkers = max(workers - 1, limits.minWorkers);
+    }
+    reason = "quiet";
+  }
+
+  if (newCapacity == capacity && newWorkers == workers) return;
+
+  if (newCapacity != capacity) service->resize(newCapacity);
+  if (newWorkers != workers) service->setActiveWorkers(newWorkers);
+
+  char line[512];
+  int length = snprintf(line, sizeof(line), "scale time_ms=%lld service=%d "
+                        "reason=%s queue=%lu->%lu workers=%d->%d depth=%lu "
+                        "producer_blocked_ms=%.3f consumer_blocked_ms=%.3f "
+                        "turned_away=%lu\n", monotonicNow() / 1000000LL, type,
+                        reason, capacity, newCapacity, workers, newWorkers,
+                        depth, producerWait / 1e6, consumerWait / 1e6,
+                        turnedAway);
+  ::write(fd, line, length);
+
+}
+
+int Autoscaler::run(void * arg) {
+
+  Autoscaler * autoscaler = (Autoscaler*) arg;
+  long long interval = SCALE_INTERVAL_MS * 1000000LL;
+  long long next = monotonicNow() + interval;
+
+  while (!autoscaler->stopping) {
+    futexWait(&autoscaler->stopping, 0, next);
+    if (autoscaler->stopping || monotonicNow() < next) continue;
+
+    for (int i = SUM; i < SERVICES_COUNT; i++) {
+      Service * service = autoscaler->middleEnd->getService(i);
+      if (service->getStatus() && service->isElastic()) {
+        autoscaler->look(i, interval);
+      }
+    }
+    next += interval;
+  }
+
+  return 0;
+
+}
+
+class FrontEnd{
+  private:
+    int defaultQueueSize;
+    int activeServices;
+    int pendingWorkers;
+    string inputFile;
+    int backendQueueSize;
+    bool backendQueueSent;
+    bool defaultQueueSent;
+    unsigned int messageTags;
+    BackEnd * backEnd;
+    bool pendingPinned;
+    cpu_set_t pendingCpus;
+    bool backendPinned;
+    cpu_set_t backendCpus;
+    int pendingPolicy;
+    int pendingSpillSize;
+    int pendingMaxSize;
+    int pendingMaxWorkers;
+    int laneSize;
+    int cacheSize;
+    bool binaryInput;
+    int outputFormat;
+    int outputFd;
+    bool ioUring;
+    string socketPath;
+    int tcpPort;
+    string sharedName;
+    int sharedSize;
+    ParsimShm * shared;
+    int unixListener;
+    int tcpListener;
+    int poller;
+    Connection * connections;
+    int nextConnection;
+    int currentOrigin;
+    int openListener(sockaddr *, socklen_t);
+    void startListening();
+    void acceptConnections(int);
+    void readConnection(int, MiddleEnd *);
+    void closeConnection(int);
+  public:
+    FrontEnd();
+    int parseMessage(const char *, int, Message &);
+    int parseList(const char *, const char *, unsigned int *, int, int);
+    int parsePipelines(const char *, const char *,
+                       unsigned int (*)[MAX_PIPELINE_STAGES], unsigned char *,
+                       int, int);
+    int parseOperand(const char *, const char *, long long &);
+    bool isNumber(string &, bool);
+    bool isOption(string &);
+    void initServices(int, char **,  BackEnd *, MiddleEnd *, Metrics *);
+    void startService(int, char **, int, MiddleEnd *, BackEnd *);
+    void startBackendService(int, char **, int, BackEnd *);
+    void setDefaultQueueSize(int, char **, int);
+    void setWorkers(int, char **, int);
+    void setElastic(int, char **, int);
+    void setInputFile(int, char **, int);
+    void setFlushPolicy(int, char **, int, BackEnd *);
+    void setMetrics(int, char **, int, Metrics *);
+    void setAggregation(int, char **, int, BackEnd *);
+    void setOrdering(int, char **, int, BackEnd *);
+    void setAffinity(int, char **, int);
+    void setStackSize(int, char **, int);
+    void setQueuePolicy(int, char **, int);
+    void setLaneSize(int, char **, int);
+    void setCacheSize(int, char **, int);
+    void setOutputFormat(int, char **, int);
+    void setOutputFile(int, char **, int);
+    void setListen(int, char **, int);
+    void setShared(int, char **, int);
+    int decodeRecord(const char *, Message &);
+    void readBinary(MiddleEnd *);
+    void readShared(MiddleEnd *);
+    void readStream(MiddleEnd *);
+    void serviceValidations(string);
+    int parseLine(const char *, int, Message &);
+    void handleMessage(int, Message &, MiddleEnd *);
+    void setProducer(Message &, MiddleEnd *);
+    void waitForMessages(MiddleEnd *);
+    void serve(MiddleEnd *);
+    void readFile(MiddleEnd *);
+};
+
+FrontEnd::FrontEnd(void){
+  defaultQueueSize = 1;
+  pendingWorkers = 0;
+  backendQueueSize = 1;
   backendQueueSent = false;
   defaultQueueSent = false;
   activeServices = 0;
+  messageTags = 0;
+  pendingPinned = false;
+  backendPinned = false;
+  pendingPolicy = -1;
+  pendingMaxSize = 0;
+  pendingMaxWorkers = 0;
+  laneSize = 0;
+  cacheSize = 0;
+  binaryInput = false;
+  outputFormat = OUTPUT_TEXT;
+  outputFd = STDOUT_FILENO;
+  ioUring = false;
+  tcpPort = 0;
+  sharedSize = SHARED_RING_SIZE;
+  shared = NULL;
+  unixListener = -1;
+  tcpListener = -1;
+  connections = NULL;
+  nextConnection = 0;
+  currentOrigin = 0;
+}
+
+void FrontEnd::setDefaultQueueSize(int argc, char* argv[],
+                                   int currentPosition) {
+
+  // Preventing from array index out of bounds exception
+  if (currentPosition + 1 < argc) {
+
+    string queueSize = argv[currentPosition+1];
+
+    if (isNumber(queueSize, false)) {
+
+      defaultQueueSize = atoi(queueSize.c_str());
+      defaultQueueSent = true;
+
+    } else {
+      cerr << DEFAULT_QUEUE_SIZE_ERR << endl;
+      exit(0);
+    }
+
+  }
+
+}
+
+/*
+  Workers always follow the service they belong to. As the command line is
+  parsed from the end, the count is kept until its -s is reached
+*/
+void FrontEnd::setWorkers(int argc, char * argv[], int currentPosition) {
+
+  string workers = currentPosition + 1 < argc ?
+                   argv[currentPosition + 1] : "";
+
+  if (workers.empty() || !isNumber(workers, false) ||
+      atoi(workers.c_str()) < 1) {
+    cerr << WORKERS_ERR << endl;
+    exit(0);
+  }
+
+  pendingWorkers = atoi(workers.c_str());
+
+}
+
+/*
+  -e maxSize maxWorkers: the service before it may grow its queue and its
+  workers up to these, and shrink them back to what it started with
+*/
+void FrontEnd::setElastic(int argc, char * argv[], int currentPosition) {
+
+  string size = currentPosition + 1 < argc ? argv[currentPosition + 1] : "";
+  string workers = currentPosition + 2 < argc ?
+                   argv[currentPosition + 2] : "";
+
+  if (size.empty() || !isNumber(size, false) || atoi(size.c_str()) < 1 ||
+      workers.empty() || !isNumber(workers, false) ||
+      atoi(workers.c_str()) < 1) {
+    cerr << ELASTIC_ERR << endl;
+    exit(0);
+  }
+
+  pendingMaxSize = atoi(size.c_str());
+  pendingMaxWorkers = atoi(workers.c_str());
+
+}
+
+/*
+  -p cpus: the workers of the service, or the backend, before it only run on
+  cpus, a comma separated list of cpus and ranges like 0,2-3
+*/
+void FrontEnd::setAffinity(int argc, char * argv[], int currentPosition) {
+
+  string list = currentPosition + 1 < argc ? argv[currentPosition + 1] : "";
+  const char * cursor = list.c_str();
+  bool correct = !list.empty();
+  cpu_set_t allowed;
+
+  CPU_ZERO(&pendingCpus);
+
+  while (correct && *cursor != '\0') {
+    char * end;
+    long first = strtol(cursor, &end, 10);
+    long last = first;
+
+    if (end != cursor && *end == '-') {
+      cursor = end + 1;
+      last = strtol(cursor, &end, 10);
+    }
+
+    correct = end != cursor && first >= 0 && last >= first &&
+              last < CPU_SETSIZE && (*end == COMMA || *end == '\0');
+
+    for (long cpu = first; correct && cpu <= last; cpu++) {
+      CPU_SET(cpu, &pendingCpus);
+    }
+
+    cursor = *end == COMMA ? end + 1 : end;
+  }
+
+  // Only the cpus parsim is allowed to run on count
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  CPU_AND(&pendingCpus, &pendingCpus, &allowed);
+
+  if (!correct || CPU_COUNT(&pendingCpus) == 0) {
+    cerr << AFFINITY_ERR << endl;
+    exit(0);
+  }
+
+  pendingPinned = true;
+
+}
+
+/*
+  -q block | reject | drop-oldest | spill[:items]: what happens to the items
+  of the service before it when its queue is full
+*/
+void FrontEnd::setQueuePolicy(int argc, char * argv[], int currentPosition) {
+
+  string policy = currentPosition + 1 < argc ? argv[currentPosition + 1] : "";
+  string items = policy.substr(policy.find(TWO_POINTS) + 1);
+
+  pendingSpillSize = SPILL_SIZE;
+
+  if (policy == "block") {
+    pendingPolicy = OVERFLOW_BLOCK;
+  } else if (policy == "reject") {
+    pendingPolicy = OVERFLOW_REJECT;
+  } else if (policy == "drop-oldest") {
+    pendingPolicy = OVERFLOW_DROP;
+  } else if (policy == "spill") {
+    pendingPolicy = OVERFLOW_SPILL;
+  } else if (policy.compare(0, 6, "spill:") == 0 && !items.empty() &&
+             isNumber(items, false) && atoi(items.c_str()) > 0) {
+    pendingPolicy = OVERFLOW_SPILL;
+    pendingSpillSize = atoi(items.c_str());
+  } else {
+    cerr << QUEUE_POLICY_ERR << endl;
+    exit(0);
+  }
+
+}
+
+/* -O text | binary | columns */
+void FrontEnd::setOutputFormat(int argc, char * argv[], int currentPosition) {
+
+  string format = currentPosition + 1 < argc ? argv[currentPosition + 1] : "";
+
+  if (format == "text") {
+    outputFormat = OUTPUT_TEXT;
+  } else if (format == "binary") {
+    outputFormat = OUTPUT_BINARY;
+  } else if (format == "columns") {
+    outputFormat = OUTPUT_COLUMNS;
+  } else {
+    cerr << OUTPUT_FORMAT_ERR << endl;
+    exit(0);
+  }
+
+}
+
+/* -o file: results go to file instead of the standard output */
+void FrontEnd::setOutputFile(int argc, char * argv[], int currentPosition) {
+
+  string file = currentPosition + 1 < argc ? argv[currentPosition + 1] : "";
+
+  if (file.empty() ||
+      (outputFd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                         0644)) < 0) {
+    cerr << OUTPUT_FILE_ERR << endl;
+    exit(0);
+  }
+
+}
+
+/* -U path | -T port: messages come from the clients of a socket */
+void FrontEnd::setListen(int argc, char * argv[], int currentPosition) {
+
+  string option = argv[currentPosition];
+  string value = currentPosition + 1 < argc ? argv[currentPosition + 1] : "";
+
+  if (option == LISTEN_UNIX && !value.empty() &&
+      value.length() < sizeof(((sockaddr_un *) NULL)->sun_path)) {
+    socketPath = value;
+  } else if (option == LISTEN_TCP && !value.empty() &&
+             isNumber(value, false) && atoi(value.c_str()) > 0 &&
+             atoi(value.c_str()) <= 65535) {
+    tcpPort = atoi(value.c_str());
+  } else {
+    cerr << LISTEN_ERR << endl;
+    exit(0);
+  }
+
+}
+
+/* -S name [size]: messages come from the shared memory rings name */
+void FrontEnd::setShared(int argc, char * argv[], int currentPosition) {
+
+  sharedName = currentPosition + 1 < argc ? argv[currentPosition + 1] : "";
+
+  if (sharedName.empty() || isOption(sharedName) ||
+      sharedName.length() + 2 > PARSIM_SHM_NAME_SIZE ||
+      sharedName.find('/', 1) != string::npos) {
+    cerr << SHARED_ERR << endl;
+    exit(0);
+  }
+
+  if (currentPosition + 2 < argc) {
+    string value = argv[currentPosition + 2];
+
+    if (!isOption(value)) {
+      if (!isNumber(value, false) || atoi(value.c_str()) < 2) {
+        cerr << SHARED_ERR << endl;
+        exit(0);
+      }
+      sharedSize = atoi(value.c_str());
+    }
+  }
+
+}
+
+/* -L items: the FrontEnd hands items to each service through a lane */
+void FrontEnd::setLaneSize(int argc, char * argv[], int currentPosition) {
+
+  string size = currentPosition + 1 < argc ? argv[currentPosition + 1] : "";
+
+  if (size.empty() || !isNumber(size, false) || atoi(size.c_str()) <= 0) {
+    cerr << LANE_SIZE_ERR << endl;
+    exit(0);
+  }
+
+  laneSize = atoi(size.c_str());
+
+}
+
+/* -R entries: repeated items are answered from a cache of results */
+void FrontEnd::setCacheSize(int argc, char * argv[], int currentPosition) {
+
+  string size = currentPosition + 1 < argc ? argv[currentPosition + 1] : "";
+
+  if (size.empty() || !isNumber(size, false) || atoi(size.c_str()) <= 0) {
+    cerr << CACHE_SIZE_ERR << endl;
+    exit(0);
+  }
+
+  cacheSize = atoi(size.c_str());
+
+}
+
+/* -t KiB: size of the stack of every thread */
+void FrontEnd::setStackSize(int argc, char * argv[], int currentPosition) {
+
+  string size = currentPosition + 1 < argc ? argv[currentPosition + 1] : "";
+
+  if (size.empty() || !isNumber(size, false) ||
+      atoll(size.c_str()) < STACK_SIZE / 1024 ||
+      atoll(size.c_str()) > INT_MAX / 1024) {
+    cerr << STACK_SIZE_ERR << endl;
+    exit(0);
+  }
+
+  threadStackSize = atoll(size.c_str()) * 1024;
+
+}
+
+void FrontEnd::setInputFile(int argc, char * argv[], int currentPosition) {
+
+  if (currentPosition + 1 >= argc) {
+    cerr << INPUT_FILE_ERR << endl;
+    exit(0);
+  }
+
+  inputFile = argv[currentPosition + 1];
+
+}
+
+/* -m <interval ms> | -M <file> */
+void FrontEnd::setMetrics(int argc, char * argv[], int currentPosition,
+                          Metrics * metrics) {
+
+  string option = argv[currentPosition];
+  string value = currentPosition + 1 < argc ? argv[currentPosition + 1] : "";
+  bool correct;
+
+  if (option == METRICS) {
+    correct = !value.empty() && isNumber(value, false) &&
+              metrics->setInterval(atoll(value.c_str()));
+  } else {
+    correct = !value.empty() && metrics->setFile(value);
+  }
+
+  if (!correct) {
+    cerr << METRICS_ERR << endl;
+    exit(0);
+  }
+
+}
+
+/* -A timeout: results of a message are written together */
+void FrontEnd::setAggregation(int argc, char * argv[], int currentPosition,
+                              BackEnd * backend) {
+
+  string timeout = currentPosition + 1 < argc ? argv[currentPosition + 1] : "";
+
+  if (timeout.empty() || !isNumber(timeout, false) ||
+      atoll(timeout.c_str()) <= 0) {
+    cerr << AGGREGATE_ERR << endl;
+    exit(0);
+  }
+
+  backend->setAggregation(atoll(timeout.c_str()));
+
+}
+
+/* --ordered [window]: results are written in input order */
+void FrontEnd::setOrdering(int argc, char * argv[], int currentPosition,
+                           BackEnd * backend) {
+
+  int window = ORDER_WINDOW;
+
+  if (currentPosition + 1 < argc) {
+    string value = argv[currentPosition + 1];
+
+    if (!isOption(value)) {
+      if (!isNumber(value, false) || atoi(value.c_str()) <= 0) {
+        cerr << ORDER_WINDOW_ERR << endl;
+        exit(0);
+      }
+      window = atoi(value.c_str());
+    }
+  }
+
+  backend->setOrdering(window);
+
+}
+
+/* -F immediate | -F size:<bytes> | -F time:<ms> */
+void FrontEnd::setFlushPolicy(int argc, char * argv[], int currentPosition,
+                              BackEnd * backend) {
+
+  string policy = currentPosition + 1 < argc ? argv[currentPosition + 1] : "";
+  string amount = policy.substr(policy.find(TWO_POINTS) + 1);
+
+  if (policy == "immediate") {
+    backend->setFlushPolicy(FLUSH_IMMEDIATE, 0);
+  } else if (policy.compare(0, 5, "size:") == 0 && !amount.empty() &&
+             amount.length() <= 9 && isNumber(amount, false) &&
+             atoi(amount.c_str()) > 0 &&
+             atoi(amount.c_str()) <= MAX_FLUSH_SIZE) {
+    backend->setFlushPolicy(FLUSH_SIZE, atoi(amount.c_str()));
+  } else if (policy.compare(0, 5, "time:") == 0 && !amount.empty() &&
+             amount.length() <= 9 && isNumber(amount, false)) {
+    backend->setFlushPolicy(FLUSH_TIME, atoi(amount.c_str()));
+  } else {
+    cerr << FLUSH_POLICY_ERR << endl;
+    exit(0);
+  }
+
+}
+
+void FrontEnd::startBackendService(int argc, char * argv[],
+                                   int currentPosition, BackEnd * backend) {
+
+  // Preventing from array index out of bounds exception
+  if (currentPosition + 1 < argc) {
+
+    string queueSize = argv[currentPosition+1];
+    int size = atoi(queueSize.c_str());
+
+    // The backend starts once every option affecting it has been read
+    if (size > 0) {
+      backendQueueSize = size;
+      backendQueueSent = true;
+    }
+
+    backendPinned = pendingPinned;
+    backendCpus = pendingCpus;
+    pendingPinned = false;
+
+  } else {
+    cerr << SET_BACKEND_QUEUE_ERR << endl;
+    exit(0);
+  }
+
+}
+
+// Method took from http://www.cplusplus.com/forum/beginner/31141/
+bool FrontEnd::isNumber(string & s, bool canBeNegative) {
+  /*
+    if s[i] is between '0' and '9' or if it's a whitespace
+    (there may be some before and after the number) it's ok.
+    otherwise it isn't a number.
+  */
+  for(int i = 0; i < s.length(); i++) {
+
+    if (canBeNegative) {
+
+      /* If the number is negative, the minus must be in the first position*/
+      if (s[i] == '-' && i != 0) return false;
+
+      if(! (s[i] >= '0' && s[i] <= '9' || s[i] == ' '
+        || s[i] == '-') ) return false;
+
+    } else{
+      if(! (s[i] >= '0' && s[i] <= '9' || s[i] == ' ') ) return false;
+    }
+
+  }
+
+  return true;
+
+}
+
+/* Whether a command line parameter is one of the options parsim accepts */
+bool FrontEnd::isOption(string & s) {
+  return s == S || s == C || s == B || s == W || s == F || s == FLUSH ||
+         s == METRICS || s == METRICS_FILE || s == AGGREGATE ||
+         s == ORDERED || s == PIN || s == THREAD_STACK || s == QUEUE_POLICY ||
+         s == LANES || s == BINARY || s == OUTPUT_FORMAT || s == OUTPUT_FILE ||
+         s == LISTEN_UNIX || s == LISTEN_TCP || s == RESULT_CACHE ||
+         s == HUGE_PAGES || s == ELASTIC || s == IO_URING || s == SHARED;
+}
+
+static bool isBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+         c == '\f';
+}
+
+/*
+  Parses a comma separated list of non negative integers lying between first
+  and last. Empty elements are skipped. Values that don't fit in values are
+  still validated but not stored. Returns how many elements were found or -1
+  if one is not a number or not below limit (0 means no limit)
+*/
+int FrontEnd::parseList(const char * first, const char * last,
+                        unsigned int * values, int maxValues, int limit) {
+
+  int count = 0;
+  const char * p = first;
+
+  while (p < last) {
+
+    if (*p == COMMA) {
+      p++;
+      continue;
+    }
+
+    unsigned long long value = 0;
+    while (p < last && *p != COMMA) {
+      if (*p < '0' || *p > '9') return -1;
+      // Like atoi, only the low bits of a huge value survive
+      value = value * 10 + (*p - '0');
+      p++;
+    }
+
+    if (limit > 0 && value >= (unsigned long long) limit) return -1;
+    if (count < maxValues) values[count] = (unsigned int) value;
+    count++;
+
+  }
+
+  return count;
+
+}
+
+/*
+  Like parseList, for lists whose elements are pipelines: up to
+  MAX_PIPELINE_STAGES values separated by NEXT_STAGE. stages gets how many
+  values each element has
+*/
+int FrontEnd::parsePipelines(const char * first, const char * last,
+                             unsigned int (*values)[MAX_PIPELINE_STAGES],
+                             unsigned char * stages, int maxValues,
+                             int limit) {
+
+  int count = 0;
+  const char * p = first;
+
+  while (p < last) {
+
+    if (*p == COMMA) {
+      p++;
+      continue;
+    }
+
+    int stage = 0;
+    while (true) {
+      const char * digits = p;
+      unsigned long long value = 0;
+
+      while (p < last && *p != COMMA && *p != NEXT_STAGE) {
+        if (*p < '0' || *p > '9') return -1;
+        value = value * 10 + (*p - '0');
+        p++;
+      }
+
+      if (p == digits || stage == MAX_PIPELINE_STAGES) return -1;
+      if (limit > 0 && value >= (unsigned long long) limit) return -1;
+      if (count < maxValues) values[count][stage] = (unsigned int) value;
+      stage++;
+
+      if (p == last || *p != NEXT_STAGE) break;
+      p++;
+    }
+
+    if (count < maxValues) stages[count] = stage;
+    count++;
+
+  }
+
+  return count;
+
+}
+
+/*
+  Converts an operand the way stoll(operand, &sz, 0) does for the characters
+  the grammar allows: a leading 0 means octal and the conversion stops at
+  the first digit that isn't valid in the base
+*/
+int FrontEnd::parseOperand(const char * first, const char * last,
+                           long long & number) {
+
+  const char * p = first;
+  bool negative = false;
+
+  /* Only digits, and a minus in the first position */
+  for (const char * c = first; c < last; c++) {
+    if (*c == '-' && c != first) return PARSE_MESSAGE_ERROR;
+    if (!(*c >= '0' && *c <= '9') && *c != '-') return PARSE_MESSAGE_ERROR;
+  }
+
+  if (*p == '-') {
+    negative = true;
+    p++;
+  }
+
+  if (p == last) return PARSE_MESSAGE_ERROR;
+
+  unsigned long long base = *p == '0' ? 8 : 10;
+  unsigned long long limit = negative ? (unsigned long long) LLONG_MAX + 1 :
+                                        (unsigned long long) LLONG_MAX;
+  unsigned long long value = 0;
+
+  for (; p < last && (unsigned long long) (*p - '0') < base; p++) {
+    unsigned long long digit = *p - '0';
+    if (value > (limit - digit) / base) return PARSE_CONVERSION_ERROR;
+    value = value * base + digit;
+  }
+
+  number = negative ? (long long) (0 - value) : (long long) value;
+
+  return PARSE_OK;
+
+}
+
+/*
+  Validates and decodes a message in a single pass over the line, without
+  copying it. Fields are separated by ':' and, as before, surrounding blanks
+  are ignored
+*/
+int FrontEnd::parseMessage(const char * line, int length, Message & message) {
+
+  const char * fieldStart[MESSAGE_FIELDS + 1];
+  const char * fieldEnd[MESSAGE_FIELDS + 1];
+  int separators = 0;
+  int fields = 0;
+  const char * end = line + length;
+
+  for (const char * p = line; p < end; ) {
+
+    if (*p == TWO_POINTS || isBlank(*p)) {
+      if (*p == TWO_POINTS) separators++;
+      p++;
+      continue;
+    }
+
+    const char * start = p;
+    while (p < end && *p != TWO_POINTS && !isBlank(*p)) p++;
+
+    if (fields <= MESSAGE_FIELDS) {
+      fieldStart[fields] = start;
+      fieldEnd[fields] = p;
+    }
+    fields++;
+
+  }
+
+  if (separators != MESSAGE_FIELDS - 1 && separators != MESSAGE_FIELDS) {
+    return PARSE_SYNTAX_ERROR;
+  }
+
+  /* It is mandatory to send 5 parameters
+    - Service Id
+    - Services to consume
+    - Parameter 1
+    - Parameter 2
+    - Delays
+  and a sixth one may follow with the priority
+  */
+  if (fields != separators + 1) return PARSE_MESSAGE_ERROR;
+
+  /* The priority goes from 0, the default, to PRIORITIES - 1, the most
+  urgent */
+  unsigned int priority = 0;
+  if (fields > MESSAGE_FIELDS &&
+      (memchr(fieldStart[PRIORITY_FIELD], COMMA,
+              fieldEnd[PRIORITY_FIELD] - fieldStart[PRIORITY_FIELD]) != NULL ||
+       parseList(fieldStart[PRIORITY_FIELD], fieldEnd[PRIORITY_FIELD],
+                 &priority, 1, PRIORITIES) != 1)) {
+    return PARSE_MESSAGE_ERROR;
+  }
+  message.priority = priority;
+
+  /* Service id must be a number without any special character*/
+  unsigned int sequence;
+  if (memchr(fieldStart[0], COMMA, fieldEnd[0] - fieldStart[0]) != NULL ||
+      parseList(fieldStart[0], fieldEnd[0], &sequence, 1, 0) != 1) {
+    return PARSE_MESSAGE_ERROR;
+  }
+  message.sequence = (int) sequence;
+
+  /* At least one service must be consumed. Also, each service must be a
+  positive integer, or a pipeline of them like 0>2 */
+  unsigned int services[MAX_MESSAGE_SERVICES][MAX_PIPELINE_STAGES];
+  int servicesCount = parsePipelines(fieldStart[1], fieldEnd[1], services,
+                                     message.stages, MAX_MESSAGE_SERVICES,
+                                     SERVICES_COUNT);
+  if (servicesCount <= 0 || servicesCount > MAX_MESSAGE_SERVICES) {
+    return PARSE_MESSAGE_ERROR;
+  }
+
+  /* Parameters 1 and 2 must be numbers, the second one may have a number per
+  pipeline stage like 4>5. Characters are checked on all of them before
+  trying to convert any of them */
+  int first = parseOperand(fieldStart[2], fieldEnd[2], message.number1);
+  int second = PARSE_OK;
+  const char * operand = fieldStart[3];
+
+  message.operandsCount = 0;
+  while (second != PARSE_MESSAGE_ERROR) {
+    const char * end = (const char *) memchr(operand, NEXT_STAGE,
+                                             fieldEnd[3] - operand);
+    if (end == NULL) end = fieldEnd[3];
+
+    if (message.operandsCount == MAX_PIPELINE_STAGES) {
+      second = PARSE_MESSAGE_ERROR;
+      break;
+    }
+
+    int result = parseOperand(operand, end,
+                              message.operands[message.operandsCount++]);
+    if (result == PARSE_MESSAGE_ERROR || second == PARSE_OK) second = result;
+
+    if (end == fieldEnd[3]) break;
+    operand = end + 1;
+  }
+
+  if (first == PARSE_MESSAGE_ERROR || second == PARSE_MESSAGE_ERROR) {
+    return PARSE_MESSAGE_ERROR;
+  }
+  if (first != PARSE_OK || second != PARSE_OK) return PARSE_CONVERSION_ERROR;
+  message.number2 = message.operands[0];
+
+  /* All delays must me a positive number below DELAY_LIMIT, one per stage
+  of a pipeline*/
+  unsigned int delays[MAX_MESSAGE_SERVICES][MAX_PIPELINE_STAGES];
+  unsigned char delayStages[MAX_MESSAGE_SERVICES];
+  int delaysCount = parsePipelines(fieldStart[4], fieldEnd[4], delays,
+                                   delayStages, servicesCount, DELAY_LIMIT);
+  if (delaysCount <= 0) return PARSE_MESSAGE_ERROR;
+
+  /*
+  Matching the length of delays and servicesToConsume.
+  There are two heuristics:
+    - If delays are greater than services array, then delays have to be omitted
+    - If services are greater than delays array, then delays have to be
+        repeated
+  The same goes for the delays of the stages of a pipeline
+  */
+  message.servicesCount = servicesCount;
+  for (int i = 0; i < servicesCount; i++) {
+    int d = min(i, delaysCount - 1);
+
+    for (int stage = 0; stage < message.stages[i]; stage++) {
+      message.stageServices[i][stage] = (unsigned char) services[i][stage];
+      message.stageDelays[i][stage] =
+        delays[d][min(stage, delayStages[d] - 1)];
+    }
+    message.services[i] = message.stageServices[i][0];
+    message.delays[i] = message.stageDelays[i][0];
+  }
+
+  return PARSE_OK;
+
+}
+
+void FrontEnd::startService (int argc, char * argv[], int currentPosition,
+                             MiddleEnd * middleEnd, BackEnd * backEnd) {
+
+    int defaultSize = 1;
+    string queueSize;
+    string service = currentPosition + 1 < argc ?
+                     argv[currentPosition + 1] : "";
+
+    if (!isNumber(service, false)) {
+      cerr << SYNTAX_ERROR << endl;
+      exit(0);
+    }
+
+    // Preventing an array index out of bounds exception
+    if (currentPosition + 2 < argc) {
+      queueSize = argv[currentPosition + 2];
+    }
+
+
+    if (!queueSize.empty()) {
+      // Queue size sent
+      if (isNumber(queueSize, false)) {
+        defaultSize = atoi(queueSize.c_str());
+      } else {
+
+        /*
+        Guarrantee that, if queue size wasn't sent, then the next char must
+        be -s || -c || -b || -w
+        */
+        if (!isOption(queueSize)){
+
+          cerr << SYNTAX_ERROR << endl;
+          exit(0);
+
+        }
+
+        // Queue size was sent but it has errors
+        if (queueSize.length() > 0 && !isNumber(queueSize, false)) {
+          defaultSize = 1;
+        }
+
+        /* If defaultQueueSize it means the user hasn't sent a default queue
+           size */
+        if (defaultQueueSize != 0) {
+          defaultSize = defaultQueueSize;
+        }
+      }
+
+    }
+
+    if (pendingPolicy >= 0) {
+      middleEnd->getService(atoi(service.c_str()))->setOverflowPolicy(
+        pendingPolicy, pendingSpillSize);
+    }
+
+    // A service without -w gets a single worker
+    int workers = pendingWorkers > 0 ? pendingWorkers : 1;
+
+    if (pendingMaxSize > 0) {
+      if (pendingMaxSize < defaultSize || pendingMaxWorkers < workers) {
+        cerr << ELASTIC_ERR << endl;
+        exit(0);
+      }
+      middleEnd->getService(atoi(service.c_str()))->setLimits(
+        pendingMaxSize, pendingMaxWorkers);
+    }
+
+    middleEnd->startService(atoi(service.c_str()), defaultSize, workers,
+                            backEnd, pendingPinned ? &pendingCpus : NULL);
+
+    pendingWorkers = 0;
+    pendingMaxSize = 0;
+    pendingPinned = false;
+    pendingPolicy = -1;
+    activeServices++;
+
+}
+
+void FrontEnd::initServices (int argc, char * argv [], BackEnd * backend,
+                             MiddleEnd * middleEnd, Metrics * metrics) {
+
+  /* Every thread takes its stack size from -t and every queue its memory
+  from the arena, so both are read first */
+  for (int i = argc-1; i > 0; i--) {
+    if (string(argv[i]) == THREAD_STACK) setStackSize(argc, argv, i);
+    if (string(argv[i]) == HUGE_PAGES) arena.useHugePages();
+  }
+
+  /* Going to parse the chain from the end to the start in order to set the
+  default queue size as soon as possible and detect if there is an error with
+  the chain entered by the user*/
+  for (int i = argc-1; i > 0; i--) {
+
+      string parameter = argv[i];
+      /* Check special characters
+      -s: Service
+      -c: Default Queue
+      -b: Backend Queue
+      -w: Workers of the previous service
+      -f: Input file
+      -F: When results are written
+      -m, -M: Metrics interval and file
+      -A: Results of a message written together
+      --ordered: Results written in input order
+      -p: Cpus of the previous service or backend
+      -q: What the previous service does when its queue is full
+      -L: Dispatch lanes between the FrontEnd and the services
+      --binary: Messages come as binary records
+      -O, -o: Format and file of the results
+      -U, -T: Messages come from the clients of a socket
+      -R: Results of repeated items come from a cache
+      -S: Messages and results go through shared memory rings
+      */
+      if (parameter == S) {
+        startService(argc, argv, i, middleEnd, backend);
+      } else if (parameter == C) {
+        setDefaultQueueSize(argc, argv, i);
+      } else if (parameter == B) {
+        startBackendService(argc, argv, i, backend);
+      } else if (parameter == W) {
+        setWorkers(argc, argv, i);
+      } else if (parameter == ELASTIC) {
+        setElastic(argc, argv, i);
+      } else if (parameter == F) {
+        setInputFile(argc, argv, i);
+      } else if (parameter == FLUSH) {
+        setFlushPolicy(argc, argv, i, backend);
+      } else if (parameter == METRICS || parameter == METRICS_FILE) {
+        setMetrics(argc, argv, i, metrics);
+      } else if (parameter == AGGREGATE) {
+        setAggregation(argc, argv, i, backend);
+      } else if (parameter == ORDERED) {
+        setOrdering(argc, argv, i, backend);
+      } else if (parameter == PIN) {
+        setAffinity(argc, argv, i);
+      } else if (parameter == QUEUE_POLICY) {
+        setQueuePolicy(argc, argv, i);
+      } else if (parameter == LANES) {
+        setLaneSize(argc, argv, i);
+      } else if (parameter == BINARY) {
+        binaryInput = true;
+      } else if (parameter == IO_URING) {
+        ioUring = true;
+      } else if (parameter == OUTPUT_FORMAT) {
+        setOutputFormat(argc, argv, i);
+      } else if (parameter == OUTPUT_FILE) {
+        setOutputFile(argc, argv, i);
+      } else if (parameter == LISTEN_UNIX || parameter == LISTEN_TCP) {
+        setListen(argc, argv, i);
+      } else if (parameter == RESULT_CACHE) {
+        setCacheSize(argc, argv, i);
+      } else if (parameter == SHARED) {
+        setShared(argc, argv, i);
+      }
+    }
+
+    // A queue policy that no service claimed
+    if (pendingPolicy >= 0) {
+      cerr << QUEUE_POLICY_ERR << endl;
+      exit(0);
+    }
+
+    // Cpus that neither a service nor the backend claimed
+    if (pendingPinned) {
+      cerr << AFFINITY_ERR << endl;
+      exit(0);
+    }
+
+    // A worker count that no service claimed was placed before every -s
+    if (pendingWorkers != 0) {
+      cerr << WORKERS_ERR << endl;
+      exit(0);
+    }
+
+    if (pendingMaxSize != 0) {
+      cerr << ELASTIC_ERR << endl;
+      exit(0);
+    }
+
+    // Validate when a queue wasn't sent and a service has no queue size
+    if (!defaultQueueSent && activeServices == 0){
+      cerr << SET_DEFAULT_SIZE_ERR << endl;
+      exit(0);
+    }
+
+    // Validate that at least there are one service active
+    if (activeServices == 0){
+      cerr << ZERO_SERVICES_ACTIVE_ERR << endl;
+      exit(0);
+    }
+
+    if (laneSize > 0) middleEnd->startLanes(laneSize);
+    if (cacheSize > 0) middleEnd->startCache(cacheSize);
+
+    if (!socketPath.empty() || tcpPort > 0) startListening();
+
+    // The rings take the place of the input and the output
+    if (!sharedName.empty()) {
+      if (binaryInput || !inputFile.empty() || connections != NULL ||
+          outputFormat != OUTPUT_TEXT || outputFd != STDOUT_FILENO) {
+        cerr << SHARED_INPUT_ERR << endl;
+        exit(0);
+      }
+
+      // A message has results for up to every binary service
+      shared = parsimShmCreate(sharedName.c_str(), sharedSize,
+                               sharedSize * BINARY_SERVICES);
+      if (shared == NULL) {
+        cerr << SHARED_MEMORY_ERR << endl;
+        exit(0);
+      }
+    }
+
+    backend->setOutput(outputFormat, outputFd, ioUring);
+    if (connections != NULL) backend->setConnections(connections);
+    if (shared != NULL) backend->setShared(shared);
+
+    // Without -b the backend queue holds a single result
+    backend->start(backendQueueSize, middleEnd->getItemsCapacity(),
+                   backendPinned ? &backendCpus : NULL);
+    backEnd = backend;
+}
+
+/* Classifies an input line: termination, empty or a message to parse */
+int FrontEnd::parseLine(const char * line, int length, Message & message) {
+
+  /* Termination condition 0 */
+  if (length == 1 && line[0] == '0') {
+    return PARSE_END;
+  }
+
+  /* If input is empty then wait again for an user input */
+  if (length == 0) {
+    return PARSE_EMPTY;
+  }
+
+  return parseMessage(line, length, message);
+
+}
+
+/* Produces a parsed message or tells the user why it was rejected */
+void FrontEnd::handleMessage(int result, Message & message,
+                             MiddleEnd * middleEnd) {
+
+  switch (result) {
+    case PARSE_OK:
+      setProducer(message, middleEnd);
+      break;
+    case PARSE_SYNTAX_ERROR:
+      cerr << SYNTAX_ERROR << endl;
+      break;
+    case PARSE_MESSAGE_ERROR:
+      cerr << MESSAGE_ERROR << endl;
+      break;
+    case PARSE_CONVERSION_ERROR:
+      cerr << CONVERSION_EXCEPTION << endl;
+      break;
+  }
+
+}
+
+void FrontEnd::waitForMessages (MiddleEnd * middleEnd) {
+
+  if (shared != NULL) {
+    readShared(middleEnd);
+    return;
+  }
+
+  if (connections != NULL) {
+    serve(middleEnd);
+    return;
+  }
+
+  if (binaryInput) {
+    readBinary(middleEnd);
+    return;
+  }
+
+  if (!inputFile.empty()) {
+    readFile(middleEnd);
+    return;
+  }
+
+  readStream(middleEnd);
+}
+
+/*
+  Reads the messages of the standard input in large blocks and parses the
+  lines where they were read; only a line cut by the end of a block is
+  copied, to be joined with the rest of it
+*/
+void FrontEnd::readStream(MiddleEnd * middleEnd) {
+
+  BlockReader reader;
+  reader.open(STDIN_FILENO, ioUring);
+
+  string carried;
+  Message message;
+  char * data;
+  int length;
+  int result;
+
+  while ((length = reader.next(data)) > 0) {
+
+    const char * line = data;
+    const char * end = data + length;
+    const char * newline;
+
+    while ((newline = (const char *) memchr(line, '\n', end - line)) != NULL) {
+      if (carried.empty()) {
+        result = parseLine(line, newline - line, message);
+      } else {
+        carried.append(line, newline - line);
+        result = parseLine(carried.data(), carried.length(), message);
+        carried.clear();
+      }
+
+      if (result == PARSE_END) return;
+      handleMessage(result, message, middleEnd);
+      line = newline + 1;
+    }
+
+    carried.append(line, end - line);
+  }
+
+  // The last line may have no newline
+  if (!carried.empty()) {
+    result = parseLine(carried.data(), carried.length(), message);
+    if (result != PARSE_END) handleMessage(result, message, middleEnd);
+  }
+
 }
 
-void FrontEnd::setDefaultQueueSize(int argc, char* argv[],
-                                   int currentPosition) {
+void FrontEnd::setProducer (Message & message, MiddleEnd * middleEnd) {
+
+  //Validate that the services are initialized
+  for (int i = 0; i < message.servicesCount; i++) {
+    for (int stage = 0; stage < message.stages[i]; stage++) {
+      Service * s = middleEnd->getService(message.stages[i] > 1 ?
+                                          message.stageServices[i][stage] :
+                                          message.services[i]);
+
+      if (!s->getStatus()) {
+        cerr << SERVICE_NOT_INITIALIZED_ERR << endl;
+        return;
+      }
+    }
+  }
+
+  ResultCache * cache = middleEnd->getCache();
+  unsigned int tag = messageTags++;
+  backEnd->admit(tag);
+
+  if (connections != NULL) {
+    connections[currentOrigin].dispatched += message.servicesCount;
+  }
+
+  for (int i = 0; i < message.servicesCount; i++) {
+
+    //Create the items that are going to be produced
+    BufferInMiddleEnd itemMiddleEnd;
+    itemMiddleEnd.sequence = message.sequence;
+    itemMiddleEnd.tag = tag;
+    itemMiddleEnd.origin = currentOrigin;
+    itemMiddleEnd.part = i;
+    itemMiddleEnd.parts = message.servicesCount;
+    itemMiddleEnd.number1 = message.number1;
+    itemMiddleEnd.number2 = message.number2;
+    itemMiddleEnd.delay = message.delays[i];
+    itemMiddleEnd.priority = message.priority;
+    itemMiddleEnd.pipeline = -1;
+    itemMiddleEnd.stage = 0;
+
+    // The workers hand the result of each stage to the next one
+    if (message.stages[i] > 1) {
+      PipelinePool * pipelines = middleEnd->getPipelines();
+      int index = pipelines->take();
+      Pipeline & pipeline = pipelines->get(index);
+
+      pipeline.stages = message.stages[i];
+      for (int stage = 0; stage < pipeline.stages; stage++) {
+        pipeline.services[stage] =
+          middleEnd->getService(message.stageServices[i][stage]);
+        pipeline.operands[stage] =
+          message.operands[min(stage, message.operandsCount - 1)];
+        pipeline.delays[stage] = message.stageDelays[i][stage];
+      }
+      itemMiddleEnd.pipeline = index;
+    }
+
+    // A result already calculated goes straight to the BackEnd
+    long long result;
+    bool defined;
+    if (cache != NULL && message.stages[i] == 1 &&
+        cache->find(message.services[i], message.number1, message.number2,
+                    result, defined)) {
+      BufferInBackEnd item;
+      item.sequence = message.sequence;
+      item.tag = tag;
+      item.origin = currentOrigin;
+      item.part = i;
+      item.parts = message.servicesCount;
+      item.service = message.services[i];
+      item.status = defined ? ITEM_OK : ITEM_DIVISION_BY_ZERO;
+      item.result = result;
+      backEnd->produce(item);
+      continue;
+    }
 
-  // Preventing from array index out of bounds exception
-  if (currentPosition + 1 < argc) {
+    //Get the service and produce the item for it
+    Service * s = middleEnd->getService(message.services[i]);
+    s->dispatch(itemMiddleEnd);
+  }
 
-    string queueSize = argv[currentPosition+1];
+}
 
-    if (isNumber(queueSize, false)) {
+/* Binds a listening socket to address, -1 if it can't */
+int FrontEnd::openListener(sockaddr * address, socklen_t length) {
 
-      defaultQueueSize = atoi(queueSize.c_str());
-      defaultQueueSent = true;
+  int enable = 1;
+  int fd = socket(address->sa_family,
+                  SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
-    } else {
-      cerr << DEFAULT_QUEUE_SIZE_ERR << endl;
-      exit(0);
-    }
+  if (fd < 0) return -1;
 
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+  if (bind(fd, address, length) < 0 || listen(fd, SOMAXCONN) < 0) {
+    ::close(fd);
+    return -1;
   }
 
+  return fd;
+
 }
 
-void FrontEnd::startBackendService(int argc, char * argv[],
-                                   int currentPosition, BackEnd * backend) {
+/*
+  Opens the sockets of -U and -T before any result can be written, and the
+  slots of the connections they accept
+*/
+void FrontEnd::startListening() {
 
-  // Preventing from array index out of bounds exception
-  if (currentPosition + 1 < argc) {
+  if (outputFormat == OUTPUT_COLUMNS) {
+    cerr << CONNECTION_COLUMNS_ERR << endl;
+    exit(0);
+  }
 
-    string queueSize = argv[currentPosition+1];
-    int size = atoi(queueSize.c_str());
+  if (!socketPath.empty()) {
+    sockaddr_un address;
+    struct stat information;
 
-    if (size > 0) {
-      backend->start(atoi(queueSize.c_str()));
-      backendQueueSent = true;
+    // A socket left behind by an earlier run is replaced
+    if (stat(socketPath.c_str(), &information) == 0 &&
+        S_ISSOCK(information.st_mode)) {
+      unlink(socketPath.c_str());
     }
 
-  } else {
-    cerr << SET_BACKEND_QUEUE_ERR << endl;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, socketPath.c_str(), socketPath.length());
+    unixListener = openListener((sockaddr *) &address, sizeof(address));
+  }
+
+  if (tcpPort > 0) {
+    sockaddr_in address;
+
+    // Only local clients, like the Unix socket
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(tcpPort);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    tcpListener = openListener((sockaddr *) &address, sizeof(address));
+  }
+
+  if ((!socketPath.empty() && unixListener < 0) ||
+      (tcpPort > 0 && tcpListener < 0)) {
+    cerr << LISTEN_SOCKET_ERR << endl;
     exit(0);
   }
 
+  connections = new Connection[MAX_CONNECTIONS];
+  for (int i = 0; i < MAX_CONNECTIONS; i++) {
+    connections[i].state = CONNECTION_FREE;
+    connections[i].readFd = -1;
+    connections[i].writeFd = -1;
+    connections[i].input = NULL;
+    connections[i].output = NULL;
+    connections[i].expected = -1;
+  }
+
 }
 
-// Method took from http://www.cplusplus.com/forum/beginner/31141/
-bool FrontEnd::isNumber(string & s, bool canBeNegative) {
-  /*
-    if s[i] is between '0' and '9' or if it's a whitespace
-    (there may be some before and after the number) it's ok.
-    otherwise it isn't a number.
-  */
-  for(int i = 0; i < s.length(); i++) {
+/*
+  Serves the clients of -U and -T until parsim gets SIGINT or SIGTERM. A
+  single thread waits on every socket with epoll; each client sends lines
+  like the standard input and gets the results of its own messages back on
+  the same connection, in the format chosen with -O. A client that sends 0,
+  or shuts down its side, gets the rest of its results and then an end of
+  stream. Messages that don't parse are reported on the standard error
+*/
+void FrontEnd::serve(MiddleEnd * middleEnd) {
+
+  sigset_t stopping;
+  epoll_event event;
+  epoll_event ready[MAX_EVENTS];
+  int listeners[] = { unixListener, tcpListener };
+  bool running = true;
+
+  sigemptyset(&stopping);
+  sigaddset(&stopping, SIGINT);
+  sigaddset(&stopping, SIGTERM);
+  sigprocmask(SIG_BLOCK, &stopping, NULL);
+  int signals = signalfd(-1, &stopping, SFD_CLOEXEC);
+
+  poller = epoll_create1(EPOLL_CLOEXEC);
+
+  // Events of connections carry their slot, the others their descriptor
+  // after the slots
+  event.events = EPOLLIN;
+  event.data.u64 = MAX_CONNECTIONS + signals;
+  epoll_ctl(poller, EPOLL_CTL_ADD, signals, &event);
+  for (int i = 0; i < 2; i++) {
+    if (listeners[i] < 0) continue;
+    event.data.u64 = MAX_CONNECTIONS + listeners[i];
+    epoll_ctl(poller, EPOLL_CTL_ADD, listeners[i], &event);
+  }
 
-    if (canBeNegative) {
+  while (running) {
 
-      /* If the number is negative, the minus must be in the first position*/
-      if (s[i] == '-' && i != 0) return false;
+    int count = epoll_wait(poller, ready, MAX_EVENTS, -1);
 
-      if(! (s[i] >= '0' && s[i] <= '9' || s[i] == ' '
-        || s[i] == '-') ) return false;
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      break;
+    }
 
-    } else{
-      if(! (s[i] >= '0' && s[i] <= '9' || s[i] == ' ') ) return false;
+    for (int i = 0; i < count; i++) {
+      unsigned long key = ready[i].data.u64;
+
+      if (key < MAX_CONNECTIONS) {
+        readConnection(key, middleEnd);
+      } else if ((int) (key - MAX_CONNECTIONS) == signals) {
+        running = false;
+      } else {
+        acceptConnections(key - MAX_CONNECTIONS);
+      }
     }
+  }
 
+  for (int i = 0; i < 2; i++) {
+    if (listeners[i] >= 0) ::close(listeners[i]);
   }
+  if (unixListener >= 0) unlink(socketPath.c_str());
 
-  return true;
+  // Their results are still written while the services finish
+  for (int i = 0; i < MAX_CONNECTIONS; i++) {
+    if (connections[i].readFd >= 0) closeConnection(i);
+  }
+
+  ::close(poller);
+  ::close(signals);
 
 }
 
-bool FrontEnd::allIntegersInVector(vector<string> s, bool validateRange) {
+/* Takes every client waiting on listener into a free slot */
+void FrontEnd::acceptConnections(int listener) {
 
-  for (int i = 0; i < s.size(); i++) {
-    if (!isNumber(s.at(i) , false)) {
-      return false;
-    }
+  int fd;
 
-    if (validateRange) {
-      if (!(atoi(s.at(i).c_str()) >= 0 && atoi(s.at(i).c_str()) < 10 )) {
-        return false;
+  while ((fd = accept4(listener, NULL, NULL,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+
+    int slot = -1;
+    for (int i = 0; i < MAX_CONNECTIONS && slot < 0; i++) {
+      int candidate = (nextConnection + i) % MAX_CONNECTIONS;
+      if (connections[candidate].state.load() == CONNECTION_FREE) {
+        slot = candidate;
       }
     }
 
-  }
+    if (slot < 0) {
+      string error = string(CONNECTIONS_ERR) + "\n";
+      send(fd, error.data(), error.length(), MSG_NOSIGNAL);
+      ::close(fd);
+      continue;
+    }
 
-  return true;
+    Connection & connection = connections[slot];
+    if (connection.input == NULL) {
+      connection.input = new char[CONNECTION_BUFFER_SIZE];
+      connection.output = new char[CONNECTION_BUFFER_SIZE];
+    }
+    connection.readFd = fd;
+    connection.inputLength = 0;
+    connection.dispatched = 0;
+    connection.state.store(CONNECTION_OPEN);
+    nextConnection = slot + 1;
+
+    // The BackEnd learns about the connection before any of its results
+    BufferInBackEnd opening;
+    memset(&opening, 0, sizeof(opening));
+    opening.origin = slot;
+    opening.status = ITEM_OPEN;
+    opening.result = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    backEnd->produce(opening);
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = slot;
+    epoll_ctl(poller, EPOLL_CTL_ADD, fd, &event);
+  }
 
 }
 
-bool FrontEnd::messageValidations(vector<string> messageParsed) {
+/*
+  Reads what a client sent and handles its complete lines. One read per
+  event, so a busy client doesn't hold the others back
+*/
+void FrontEnd::readConnection(int slot, MiddleEnd * middleEnd) {
 
-  /* It is mandatory to send 5 parameters
-    - Service Id
-    - Services to consume
-    - Parameter 1
-    - Parameter 2
-    - Delays
-  */
-  if (messageParsed.size() != 5) {
-    cerr << MESSAGE_ERROR << endl;
-    return false;
+  Connection & connection = connections[slot];
+  Message message;
+
+  if (connection.readFd < 0) return;
+
+  ssize_t count = read(connection.readFd,
+                       connection.input + connection.inputLength,
+                       CONNECTION_BUFFER_SIZE - connection.inputLength);
+
+  if (count < 0 && (errno == EINTR || errno == EAGAIN)) return;
+
+  // At the end of the stream the last line may have no new line
+  if (count <= 0) {
+    int result = count == 0 && connection.inputLength > 0 ?
+                 parseLine(connection.input, connection.inputLength,
+                           message) : PARSE_END;
+    if (result != PARSE_END) {
+      currentOrigin = slot;
+      handleMessage(result, message, middleEnd);
+    }
+    closeConnection(slot);
+    return;
   }
 
-  string serviceId = messageParsed.at(0);
+  connection.inputLength += count;
 
-  /* Service Id must not have any special character*/
-  if (serviceId.find(COMMA) < serviceId.length()) {
-    cerr << MESSAGE_ERROR << endl;
-    return false;
+  char * line = connection.input;
+  char * end = connection.input + connection.inputLength;
+  char * newLine;
+
+  while ((newLine = (char *) memchr(line, '\n', end - line)) != NULL) {
+    int result = parseLine(line, newLine - line, message);
+
+    if (result == PARSE_END) {
+      closeConnection(slot);
+      return;
+    }
+
+    currentOrigin = slot;
+    handleMessage(result, message, middleEnd);
+    line = newLine + 1;
   }
 
-  /* Service id must be a number*/
-  if (!isNumber(serviceId, false)) {
-    cerr << MESSAGE_ERROR << endl;
-    return false;
+  // A line longer than the buffer can't be a message
+  if (line == connection.input &&
+      connection.inputLength == CONNECTION_BUFFER_SIZE) {
+    cerr << SYNTAX_ERROR << endl;
+    closeConnection(slot);
+    return;
   }
 
-  string servicesToConsume = messageParsed.at(1);
-  vector<string> servicesSplitted = splitMessage(servicesToConsume, COMMA);
+  connection.inputLength = end - line;
+  memmove(connection.input, line, connection.inputLength);
 
-  /* At least on service must be consumed. Also, each service must be a
-  positive integer */
-  if (servicesSplitted.size() == 0 ||
-     !allIntegersInVector(servicesSplitted, true)) {
-    cerr << MESSAGE_ERROR << endl;
-    return false;
-  }
+}
 
-  string parameter1 = messageParsed.at(2);
-  string parameter2 = messageParsed.at(3);
+/*
+  Stops reading from a client. The BackEnd closes the connection after the
+  last of the items it dispatched
+*/
+void FrontEnd::closeConnection(int slot) {
 
-  /* Parameters 1 and 2 must be numbers*/
-  if (!isNumber(parameter1, true) || !isNumber(parameter2, true)) {
-    cerr << MESSAGE_ERROR << endl;
-    return false;
-  }
+  Connection & connection = connections[slot];
+
+  epoll_ctl(poller, EPOLL_CTL_DEL, connection.readFd, NULL);
+  ::close(connection.readFd);
+  connection.readFd = -1;
+
+  BufferInBackEnd closing;
+  memset(&closing, 0, sizeof(closing));
+  closing.origin = slot;
+  closing.status = ITEM_CLOSE;
+  closing.result = connection.dispatched;
+  backEnd->produce(closing);
+
+}
 
-  try {
+/*
+  Reads the file given with -f. The file is memory mapped and cut in line
+  aligned chunks that several threads parse at the same time. Parsed chunks
+  go to a window of slots; the FrontEnd takes them back in file order, so
+  messages and errors come out exactly as if the file had been piped to
+  stdin. A parser may only run as far ahead as the window allows, which
+  bounds the memory used by parsed messages.
+
+  The parser threads share the heap with the FrontEnd without any locking,
+  so every slot is allocated before they start. The shortest valid message,
+  "0:0:0:0:0", takes 9 bytes, which bounds how many messages a chunk holds.
+*/
+class FileReader {
+  private:
+    struct ChunkSlot {
+      unsigned char * results;
+      Message * messages;
+      int linesCount;
+      // Number of the last chunk parsed into this slot, plus one
+      atomic<int> parsed;
+    };
+    FrontEnd * frontEnd;
+    const char * data;
+    vector<long> boundaries;
+    long largestChunk;
+    ChunkSlot * slots;
+    int slotsCount;
+    atomic<int> nextChunk;
+    atomic<int> dispatched;
+    atomic<bool> finished;
+    void parseChunk(int, ChunkSlot &);
+  public:
+    FileReader(FrontEnd *);
+    bool open(string &);
+    static int parse(void *);
+    void dispatch(MiddleEnd *);
+};
+
+FileReader::FileReader(FrontEnd * frontEnd) {
+  this->frontEnd = frontEnd;
+  data = NULL;
+  slots = NULL;
+  largestChunk = 0;
+  nextChunk = 0;
+  dispatched = 0;
+  finished = false;
+}
+
+/* Maps the file and finds where every chunk starts */
+bool FileReader::open(string & path) {
 
-    string::size_type sz = 0;   // alias of size_t
-    long long longParameter1 = stoll(parameter1,&sz,0);
-    long long longParameter2 = stoll(parameter2,&sz,0);
+  int fd = ::open(path.c_str(), O_RDONLY);
+  struct stat information;
 
-  } catch (out_of_range) {
-    cerr << CONVERSION_EXCEPTION << endl;
+  if (fd < 0) return false;
+
+  if (fstat(fd, &information) < 0) {
+    ::close(fd);
     return false;
   }
 
-  string delays = messageParsed.at(4);
-  vector<string> delaysSplitted = splitMessage(delays, COMMA);
+  long size = information.st_size;
+  boundaries.push_back(0);
 
-  /* All delays must me a positive number*/
+  if (size > 0) {
+    data = (const char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      ::close(fd);
+      return false;
+    }
+    madvise((void *) data, size, MADV_SEQUENTIAL);
+
+    // Move every cut forward to the start of the next line
+    long cut = FILE_CHUNK_SIZE;
+    while (cut < size) {
+      const char * newLine = (const char *) memchr(data + cut, '\n',
+                                                   size - cut);
+      if (newLine == NULL) break;
+      cut = newLine - data + 1;
+      if (cut < size) boundaries.push_back(cut);
+      cut += FILE_CHUNK_SIZE;
+    }
+    boundaries.push_back(size);
+  }
 
-  if (!allIntegersInVector(delaysSplitted, false)) {
-    cerr << MESSAGE_ERROR << endl;
-    return false;
+  for (size_t i = 0; i + 1 < boundaries.size(); i++) {
+    largestChunk = max(largestChunk, boundaries[i + 1] - boundaries[i]);
   }
 
+  ::close(fd);
+
   return true;
 
 }
 
-/* Splits a string depending on a separator sent as a parameter*/
-vector<string> FrontEnd::splitMessage(string str, char separator) {
+void FileReader::parseChunk(int chunk, ChunkSlot & slot) {
 
-  for (int i=0; i<str.length(); i++){
+  const char * line = data + boundaries[chunk];
+  const char * end = data + boundaries[chunk + 1];
+  int lines = 0;
+  int messages = 0;
 
-    if (str[i] == separator){
-      str[i] = WHITE_SPACE;
-    }
+  while (line < end) {
+    const char * newLine = (const char *) memchr(line, '\n', end - line);
+    const char * lineEnd = newLine != NULL ? newLine : end;
 
-  }
+    int result = frontEnd->parseLine(line, lineEnd - line,
+                                     slot.messages[messages]);
+    if (result != PARSE_EMPTY) {
+      slot.results[lines++] = result;
+    }
+    if (result == PARSE_OK) {
+      messages++;
+    }
 
-  vector<string> array;
-  stringstream ss(str);
-  string temp;
-  while (ss >> temp){
-    array.push_back(temp);
+    line = lineEnd + 1;
   }
 
-  return array;
+  slot.linesCount = lines;
 
 }
 
-void FrontEnd::startService (int argc, char * argv[], int currentPosition,
-                             MiddleEnd * middleEnd, BackEnd * backEnd) {
+/* Body of a parser thread */
+int FileReader::parse(void * arg) {
 
-    int defaultSize = 1;
-    string queueSize;
-    string service = currentPosition + 1 < argc ?
-                     argv[currentPosition + 1] : "";
+  FileReader * reader = (FileReader*) arg;
+  int chunks = reader->boundaries.size() - 1;
 
-    if (!isNumber(service, false)) {
-      cerr << SYNTAX_ERROR << endl;
-      exit(0);
-    }
+  while (!reader->finished) {
+    int chunk = reader->nextChunk.fetch_add(1);
+    if (chunk >= chunks) break;
 
-    // Preventing an array index out of bounds exception
-    if (currentPosition + 2 < argc) {
-      queueSize = argv[currentPosition + 2];
+    // Wait until the FrontEnd has emptied the slot of this chunk
+    while (true) {
+      int observed = reader->dispatched.load();
+      if (chunk < observed + reader->slotsCount || reader->finished) break;
+      futexWait(&reader->dispatched, observed);
     }
+    if (reader->finished) break;
 
+    ChunkSlot & slot = reader->slots[chunk % reader->slotsCount];
+    reader->parseChunk(chunk, slot);
+    slot.parsed.store(chunk + 1);
+    futexWake(&slot.parsed, INT_MAX);
+  }
 
-    if (!queueSize.empty()) {
-      // Queue size sent
-      if (isNumber(queueSize, false)) {
-        defaultSize = atoi(queueSize.c_str());
-      } else {
+  return 0;
 
-        /*
-        Guarrantee that, if queue size wasn't sent, then the next char must
-        be -s || -c || -b
-        */
-        if (queueSize.find(S) > queueSize.length() && queueSize.find(B) >
-            queueSize.length() && queueSize.find(C) > queueSize.length()){
+}
 
-          cerr << SYNTAX_ERROR << endl;
-          exit(0);
+void FileReader::dispatch(MiddleEnd * middleEnd) {
 
-        }
+  int chunks = boundaries.size() - 1;
+  int parsers = sysconf(_SC_NPROCESSORS_ONLN);
+  vector<pid_t> parserThreads;
 
-        // Queue size was sent but it has errors
-        if (queueSize.length() > 0 && !isNumber(queueSize, false)) {
-          defaultSize = 1;
-        }
+  if (parsers < 1) parsers = 1;
+  if (parsers > MAX_FILE_PARSERS) parsers = MAX_FILE_PARSERS;
+  if (parsers > chunks) parsers = chunks;
 
-        /* If defaultQueueSize it means the user hasn't sent a default queue
-           size */
-        if (defaultQueueSize != 0) {
-          defaultSize = defaultQueueSize;
-        }
-      }
+  slotsCount = parsers * 2;
+  slots = new ChunkSlot[slotsCount];
+  for (int i = 0; i < slotsCount; i++) {
+    slots[i].results = new unsigned char[largestChunk];
+    slots[i].messages = new Message[largestChunk / 9 + 2];
+    slots[i].parsed = 0;
+  }
+
+  for (int i = 0; i < parsers; i++) {
+    parserThreads.push_back(spawnThread(FileReader::parse, this));
+  }
 
+  for (int chunk = 0; chunk < chunks && !finished; chunk++) {
+    ChunkSlot & slot = slots[chunk % slotsCount];
+
+    while (true) {
+      int observed = slot.parsed.load();
+      if (observed == chunk + 1) break;
+      futexWait(&slot.parsed, observed);
     }
 
-    middleEnd->startService(atoi(service.c_str()), defaultSize, backEnd);
+    Message * message = slot.messages;
+    for (int i = 0; i < slot.linesCount; i++) {
+      if (slot.results[i] == PARSE_END) {
+        finished = true;
+        break;
+      }
+      frontEnd->handleMessage(slot.results[i], *message, middleEnd);
+      if (slot.results[i] == PARSE_OK) message++;
+    }
 
-    activeServices++;
+    dispatched.fetch_add(1);
+    futexWake(&dispatched, INT_MAX);
+  }
 
-}
+  finished = true;
+  futexWake(&dispatched, INT_MAX);
 
-void FrontEnd::initServices (int argc, char * argv [], BackEnd * backend,
-                             MiddleEnd * middleEnd) {
+  for (size_t i = 0; i < parserThreads.size(); i++) {
+    joinThread(parserThreads[i]);
+  }
 
-  /* Going to parse the chain from the end to the start in order to set the
-  default queue size as soon as possible and detect if there is an error with
-  the chain entered by the user*/
-  for (int i = argc-1; i > 0; i--) {
+  for (int i = 0; i < slotsCount; i++) {
+    delete [] slots[i].results;
+    delete [] slots[i].messages;
+  }
+  delete [] slots;
 
-      string parameter = argv[i];
-      /* Check special characters
-      -s: Service
-      -c: Default Queue
-      -b: Backend Queue
-      */
-      if (parameter.find(S) < parameter.length()) {
-        startService(argc, argv, i, middleEnd, backend);
-      } else if (parameter.find(C) < parameter.length()) {
-        setDefaultQueueSize(argc, argv, i);
-      } else if (parameter.find(B) < parameter.length()) {
-        startBackendService(argc, argv, i, backend);
-      }
-    }
+}
 
-    // Validate that backend queue was sent
-    if (!backendQueueSent) {
-      backend->start(1);
-    }
+void FrontEnd::readFile(MiddleEnd * middleEnd) {
 
-    // Validate when a queue wasn't sent and a service has no queue size
-    if (!defaultQueueSent && activeServices == 0){
-      cerr << SET_DEFAULT_SIZE_ERR << endl;
-      exit(0);
-    }
+  FileReader reader(this);
+
+  if (!reader.open(inputFile)) {
+    cerr << INPUT_FILE_ERR << endl;
+    exit(0);
+  }
+
+  reader.dispatch(middleEnd);
 
-    // Validate that at least there are one service active
-    if (activeServices == 0){
-      cerr << ZERO_SERVICES_ACTIVE_ERR << endl;
-      exit(0);
-    }
 }
 
-void FrontEnd::waitForMessages (MiddleEnd * middleEnd) {
+/* Decodes one binary record, checked like a text message */
+int FrontEnd::decodeRecord(const char * data, Message & message) {
 
-  string input;
-  bool isMessageCorrect = false;
+  BinaryRecord record;
+  memcpy(&record, data, sizeof(record));
 
-  while (getline(cin, input)) {
+  if (record.sequence < 0 || record.services == 0 ||
+      record.services >> BINARY_SERVICES != 0 ||
+      record.priority >= PRIORITIES) {
+    return PARSE_MESSAGE_ERROR;
+  }
 
-    /* Termination condition 0 */
-    if (input == "0") {
-      break;
+  message.sequence = record.sequence;
+  message.priority = record.priority;
+  message.number1 = record.number1;
+  message.number2 = record.number2;
+  message.operandsCount = 1;
+  message.operands[0] = record.number2;
+  message.servicesCount = 0;
+
+  for (int service = SUM; service < BINARY_SERVICES; service++) {
+    if (record.services & (1 << service)) {
+      if (record.delays[service] >= DELAY_LIMIT) return PARSE_MESSAGE_ERROR;
+      message.services[message.servicesCount] = service;
+      message.delays[message.servicesCount] = record.delays[service];
+      message.stages[message.servicesCount] = 1;
+      message.servicesCount++;
     }
+  }
 
-    /* If input is empty then wait again for an user input */
-    if (input.empty()) {
-      continue;
-    }
+  return PARSE_OK;
 
-    if (count(input.begin(), input.end(), ':') != 4) {
-      cerr << SYNTAX_ERROR << endl;
-      continue;
-    }
+}
 
-    vector<string> messageParsed = splitMessage(input, TWO_POINTS);
-    isMessageCorrect = messageValidations(messageParsed);
+/*
+  Reads binary records from the file given with -f, or the standard input,
+  in large blocks that are appended to what is left of the previous one and
+  decoded there. A record cut by the end of a block is moved to the start of
+  the buffer and completed by the next block
+*/
+void FrontEnd::readBinary(MiddleEnd * middleEnd) {
 
-    if (isMessageCorrect) {
-      setProducer(messageParsed, middleEnd);
-    }
+  int fd = STDIN_FILENO;
+
+  if (!inputFile.empty() && (fd = ::open(inputFile.c_str(), O_RDONLY)) < 0) {
+    cerr << INPUT_FILE_ERR << endl;
+    exit(0);
   }
-}
 
-void FrontEnd::setProducer (vector<string> messages, MiddleEnd * middleEnd) {
+  BlockReader reader;
+  reader.open(fd, ioUring);
 
-  string sequence = messages.at(0);
-  /* We have right now the certainty that all parameters are ok so we can
-  use them directly*/
-  string parameter1 = messages.at(2);
-  string parameter2 = messages.at(3);
+  char * buffer = new char[BINARY_BUFFER_SIZE];
+  int length = 0;
+  bool started = false;
+  char * data;
+  int count;
+  Message message;
 
-  string servicesToConsume = messages.at(1);
-  vector<string> servicesSplitted = splitMessage(servicesToConsume, COMMA);
+  // What is left of a block is always less than a record
+  while ((count = reader.next(data)) > 0) {
 
-  string delays = messages.at(4);
-  vector<string> delaysSplitted = splitMessage(delays, COMMA);
+    memcpy(buffer + length, data, count);
+    length += count;
 
-  int servicesSize = servicesSplitted.size();
-  int delaysSize = delaysSplitted.size();
-  int diff = 0;
+    int position = 0;
 
-  /*
-  Validating the length of delays and servicesToConsume.
-  There are two heuristics:
-    - If delays are greater than services array, then delays have to be omitted
-    - If services are greater than delays array, then delays have to be
-        repeated
-  */
-  if (delaysSize > servicesSize) {
+    if (!started) {
+      if (length < (int) sizeof(BinaryHeader)) continue;
 
-    diff = delaysSize - servicesSize;
-    for (int i = 0; i < diff; i++) {
-      delaysSplitted.pop_back();
+      BinaryHeader header;
+      memcpy(&header, buffer, sizeof(header));
+      if (memcmp(header.magic, BINARY_MAGIC, sizeof(header.magic)) != 0 ||
+          header.version != BINARY_VERSION ||
+          header.recordSize != sizeof(BinaryRecord)) {
+        cerr << BINARY_HEADER_ERR << endl;
+        exit(0);
+      }
+      started = true;
+      position = sizeof(header);
     }
 
-  } else if (servicesSize > delaysSize){
-
-    diff = servicesSize - delaysSize;
-    for (int i = 0; i < diff; i++) {
-      delaysSplitted.push_back(delaysSplitted.at(delaysSize-1));
+    while (length - position >= (int) sizeof(BinaryRecord)) {
+      handleMessage(decodeRecord(buffer + position, message), message,
+                    middleEnd);
+      position += sizeof(BinaryRecord);
     }
 
+    memmove(buffer, buffer + position, length - position);
+    length -= position;
   }
 
-  //Validate that the services are initialized
-  for (int i = 0; i < servicesSplitted.size(); i++) {
-    int actualService = atoi(servicesSplitted.at(i).c_str());
-    Service * s = middleEnd->getService(actualService);
-
-    if (!s->getStatus()) {
-      cerr << SERVICE_NOT_INITIALIZED_ERR << endl;
-      return;
-    }
+  if (!started || length > 0) {
+    cerr << (started ? BINARY_TRUNCATED_ERR : BINARY_HEADER_ERR) << endl;
   }
 
-  for (int i = 0; i < servicesSplitted.size(); i++) {
+  if (fd != STDIN_FILENO) ::close(fd);
+  delete [] buffer;
+
+}
 
-    string::size_type sz = 0;   // alias of size_t
+/*
+  Takes the messages other processes put in the ring of -S until one of
+  them finishes it, or parsim gets SIGINT or SIGTERM. Signals are blocked
+  and looked at whenever the ring has been empty for a while, since the
+  futex of the ring can't be waited on together with a signalfd
+*/
+void FrontEnd::readShared(MiddleEnd * middleEnd) {
 
-    //Create the items that are going to be produced
-    BufferInMiddleEnd itemMiddleEnd;
-    itemMiddleEnd.sequence = atoi(sequence.c_str());
-    itemMiddleEnd.number1 = stoll(parameter1,&sz,0);
-    itemMiddleEnd.number2 = stoll(parameter2,&sz,0);
-    itemMiddleEnd.delay = atoi(delaysSplitted.at(i).c_str());
+  sigset_t stopping;
+  sigset_t pending;
+  char record[sizeof(BinaryRecord)];
+  Message message;
 
-    //Get the service and produce the item for it
-    int actualService = atoi(servicesSplitted.at(i).c_str());
-    Service * s = middleEnd->getService(actualService);
-    s->produce(itemMiddleEnd);
+  sigemptyset(&stopping);
+  sigaddset(&stopping, SIGINT);
+  sigaddset(&stopping, SIGTERM);
+  sigprocmask(SIG_BLOCK, &stopping, NULL);
+
+  while (true) {
+
+    if (parsimShmPop(&shared->messages, record, SHARED_POLL_MS)) {
+      handleMessage(decodeRecord(record, message), message, middleEnd);
+      continue;
+    }
+
+    if (parsimShmClosed(&shared->messages)) {
+      // What was pushed before the ring closed is still taken
+      while (parsimShmTryPop(&shared->messages, record)) {
+        handleMessage(decodeRecord(record, message), message, middleEnd);
+      }
+      break;
+    }
+
+    sigpending(&pending);
+    if (sigismember(&pending, SIGINT) || sigismember(&pending, SIGTERM)) {
+      break;
+    }
   }
 
+  // Clients mapped already keep their rings until every result is read
+  char path[PARSIM_SHM_NAME_SIZE];
+  parsimShmPath(sharedName.c_str(), path);
+  shm_unlink(path);
+
 }
 
 int main(int argc, char * argv[]) {
@@ -814,38 +6131,33 @@ int main(int argc, char * argv[]) {
     BackEnd backend;
     MiddleEnd middleEnd;
     FrontEnd frontEnd;
-
-    /*Front end will start services and parse messages if the former was
-    done right*/
-    frontEnd.initServices(argc, argv, &backend, &middleEnd);
-    frontEnd.waitForMessages(&middleEnd);
+    Metrics metrics;
+    Autoscaler autoscaler;
 
     /*
-      Wait for the threads to finish. The parent with be signaled when the
-      children are dead and then the parent kill them
+      Results don't go through cout, so there is nothing for reading cin or
+      writing cerr to flush
     */
-    pid_t w;
-    int status;
-    int threadsSize = threads.size();
+    cin.tie(NULL);
+    cerr.tie(NULL);
 
-    for (int i=0; i < threadsSize; i++) {
-      w = waitpid(threads[i], &status, 0);
-    }
-
-    /* The following code is commented for a purpose. The day of the explanation
-       this approach will be mentioned
+    selectBatchKernels();
 
-       sleep(20);
-       for (int i = 0; i < threads.size(); ++i){
-         kill(threads.at(i), 9);
-       }
+    /*Front end will start services and parse messages if the former was
+    done right*/
+    frontEnd.initServices(argc, argv, &backend, &middleEnd, &metrics);
+    metrics.start(&middleEnd, &backend);
+    autoscaler.start(&middleEnd, metrics.getFd());
+    frontEnd.waitForMessages(&middleEnd);
 
+    /*
+      The input is over: let the services finish the items they hold, then
+      the backend write every result, before leaving
     */
-
-    if (w == -1) {
-         perror("waitpid");
-         exit(EXIT_FAILURE);
-    }
+    autoscaler.stop();
+    middleEnd.stop();
+    backend.stop();
+    metrics.stop();
 
     return 0;
 
@@ -0,0 +1,490 @@
+/*
+  Shared memory rings of parsim (-S name).
+
+  parsim creates the POSIX shared memory object /name with two rings: one
+  of messages, which any number of local processes fill, and one of
+  results, which parsim fills from its backend. Records are the ones of
+  --binary and -O binary, so nothing is encoded as text or copied through
+  a pipe. Like the queues inside parsim, every cell carries a sequence that
+  tells whether it can be written or read, and a process that finds a ring
+  full or empty sleeps on a futex word. The futexes are not private, so
+  they wake processes that mapped the object at different addresses.
+
+  parsim waits for room in the ring of results like it waits for a slow
+  pipe, so results must be read while messages are sent: a client that
+  sends everything before reading anything stops once the messages don't
+  fit in the rings and queues. A client either reads the results from
+  another thread, or tries to send and reads what is ready whenever the
+  ring of messages is full:
+
+      ParsimShm * shm = parsimShmOpen("name");
+      ParsimShmMessage message = { sequence, services, 0, 3, 4, { 0 } };
+      ParsimShmResult result;
+      for (each message) {
+        while (!parsimShmTrySend(shm, message)) {
+          if (parsimShmTryReceive(shm, result)) use(result);
+        }
+      }
+      parsimShmFinish(shm);
+      while (parsimShmReceive(shm, result)) use(result);
+      parsimShmUnmap(shm);
+
+  parsimShmFinish tells parsim that no more messages are coming, like the
+  0 of the standard input; parsim closes the ring of results once the last
+  one is in it, and parsimShmReceive returns false after reading it. Every
+  result goes to the same ring, so a single reader should take them and
+  match them to their messages by sequence.
+
+  Where the cells are and how many there are is read from the object once,
+  when it is created or opened, and kept in the private ParsimShm of each
+  process; what another process writes in the object can't move them.
+*/
+#ifndef PARSIM_SHM_H
+#define PARSIM_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define PARSIM_SHM_MAGIC "PSHM"
+#define PARSIM_SHM_VERSION 1
+#define PARSIM_SHM_NAME_SIZE 256
+#define PARSIM_SHM_SERVICES 10
+
+/* A message, laid out like a record of --binary */
+struct ParsimShmMessage {
+  int32_t sequence;
+  uint16_t services;
+  uint16_t priority;
+  int64_t number1;
+  int64_t number2;
+  uint32_t delays[PARSIM_SHM_SERVICES];
+};
+
+/* A result, laid out like a record of -O binary */
+struct ParsimShmResult {
+  int32_t sequence;
+  uint8_t service;
+  uint8_t status;
+  uint16_t reserved;
+  int64_t result;
+};
+
+/*
+  What the processes share about a ring. Positions only grow. Producers and
+  consumers keep their side on cache lines of their own; pushes and pops
+  change on every push and pop so a sleeper on them wakes up, and the
+  waiters say whether anybody sleeps
+*/
+struct ParsimShmRing {
+  alignas(64) uint64_t tail;
+  uint32_t pushes;
+  uint32_t emptyWaiters;
+  alignas(64) uint64_t head;
+  uint32_t pops;
+  uint32_t fullWaiters;
+  alignas(64) uint64_t offset;
+  uint32_t capacity;
+  uint32_t recordSize;
+  uint32_t closed;
+};
+
+/* Start of the object, followed by the cells of both rings */
+struct ParsimShmHeader {
+  char magic[4];
+  uint16_t version;
+  uint16_t reserved;
+  uint64_t size;
+  ParsimShmRing messages;
+  ParsimShmRing results;
+};
+
+/* A ring as a process sees it, with its own copy of where the cells are */
+struct ParsimShmQueue {
+  ParsimShmRing * ring;
+  char * cells;
+  uint32_t capacity;
+  uint32_t recordSize;
+};
+
+/* The mapping of a process */
+struct ParsimShm {
+  ParsimShmHeader * header;
+  uint64_t size;
+  ParsimShmQueue messages;
+  ParsimShmQueue results;
+};
+
+static_assert(sizeof(ParsimShmMessage) == 64, "messages must be 64 bytes");
+static_assert(sizeof(ParsimShmResult) == 16, "results must be 16 bytes");
+
+/* Shared memory names start with a slash, which may be left out */
+static inline void parsimShmPath(const char * name, char * path) {
+
+  path[0] = '/';
+  strncpy(path + 1, name[0] == '/' ? name + 1 : name,
+          PARSIM_SHM_NAME_SIZE - 2);
+  path[PARSIM_SHM_NAME_SIZE - 1] = '\0';
+
+}
+
+/* Sleeps while word holds expected, at most timeoutMs when it isn't 0 */
+static inline void parsimShmWait(uint32_t * word, uint32_t expected,
+                                 long timeoutMs = 0) {
+
+  timespec timeout;
+  timeout.tv_sec = timeoutMs / 1000;
+  timeout.tv_nsec = timeoutMs % 1000 * 1000000L;
+  syscall(SYS_futex, word, FUTEX_WAIT, expected,
+          timeoutMs > 0 ? &timeout : NULL, NULL, 0);
+
+}
+
+static inline void parsimShmWake(uint32_t * word, int count) {
+  syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+/* The cell of a position: its sequence, then its record */
+static inline uint64_t * parsimShmCell(ParsimShmQueue * queue,
+                                       uint64_t position) {
+  return (uint64_t *) (queue->cells + position % queue->capacity *
+                       (sizeof(uint64_t) + queue->recordSize));
+}
+
+/*
+  Puts record in the ring, false when it is full. A cell whose sequence is
+  ahead of a tail that didn't move was written by nobody that follows the
+  protocol, and is taken as a full ring rather than waited for
+*/
+static inline bool parsimShmTryPush(ParsimShmQueue * queue,
+                                    const void * record) {
+
+  ParsimShmRing * ring = queue->ring;
+  uint64_t position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  uint64_t * cell;
+
+  while (true) {
+    cell = parsimShmCell(queue, position);
+    uint64_t sequence = __atomic_load_n(cell, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t) (sequence - position);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->tail, &position, position + 1,
+                                      true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      uint64_t current = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+      if (current == position) return false;
+      position = current;
+    }
+  }
+
+  memcpy(cell + 1, record, queue->recordSize);
+  __atomic_store_n(cell, position + 1, __ATOMIC_RELEASE);
+
+  __atomic_fetch_add(&ring->pushes, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->emptyWaiters, __ATOMIC_SEQ_CST) > 0) {
+    parsimShmWake(&ring->pushes, 1);
+  }
+
+  return true;
+
+}
+
+/* Takes the oldest record of the ring, false when it is empty */
+static inline bool parsimShmTryPop(ParsimShmQueue * queue, void * record) {
+
+  ParsimShmRing * ring = queue->ring;
+  uint64_t position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  uint64_t * cell;
+
+  while (true) {
+    cell = parsimShmCell(queue, position);
+    uint64_t sequence = __atomic_load_n(cell, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t) (sequence - (position + 1));
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->head, &position, position + 1,
+                                      true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      uint64_t current = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+      if (current == position) return false;
+      position = current;
+    }
+  }
+
+  memcpy(record, cell + 1, queue->recordSize);
+  __atomic_store_n(cell, position + queue->capacity, __ATOMIC_RELEASE);
+
+  __atomic_fetch_add(&ring->pops, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->fullWaiters, __ATOMIC_SEQ_CST) > 0) {
+    parsimShmWake(&ring->pops, 1);
+  }
+
+  return true;
+
+}
+
+/* Waits for room in the ring for record */
+static inline void parsimShmPush(ParsimShmQueue * queue, const void * record) {
+
+  ParsimShmRing * ring = queue->ring;
+
+  if (parsimShmTryPush(queue, record)) return;
+
+  // Registered before reading the word, like the queues of parsim
+  __atomic_fetch_add(&ring->fullWaiters, 1, __ATOMIC_SEQ_CST);
+  while (true) {
+    uint32_t observed = __atomic_load_n(&ring->pops, __ATOMIC_SEQ_CST);
+    if (parsimShmTryPush(queue, record)) break;
+    parsimShmWait(&ring->pops, observed);
+  }
+  __atomic_fetch_sub(&ring->fullWaiters, 1, __ATOMIC_SEQ_CST);
+
+}
+
+/*
+  Waits for a record of the ring. Returns false once the ring is closed
+  and empty, or when nothing came within timeoutMs if it isn't 0
+*/
+static inline bool parsimShmPop(ParsimShmQueue * queue, void * record,
+                                long timeoutMs = 0) {
+
+  ParsimShmRing * ring = queue->ring;
+
+  if (parsimShmTryPop(queue, record)) return true;
+
+  bool popped = false;
+
+  __atomic_fetch_add(&ring->emptyWaiters, 1, __ATOMIC_SEQ_CST);
+  while (true) {
+    uint32_t observed = __atomic_load_n(&ring->pushes, __ATOMIC_SEQ_CST);
+    if ((popped = parsimShmTryPop(queue, record))) break;
+    if (__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST)) break;
+    parsimShmWait(&ring->pushes, observed, timeoutMs);
+    if (timeoutMs > 0) {
+      popped = parsimShmTryPop(queue, record);
+      break;
+    }
+  }
+  __atomic_fetch_sub(&ring->emptyWaiters, 1, __ATOMIC_SEQ_CST);
+
+  return popped;
+
+}
+
+/* Nothing else is pushed: the sleepers of the ring wake up to see it */
+static inline void parsimShmClose(ParsimShmQueue * queue) {
+
+  ParsimShmRing * ring = queue->ring;
+
+  __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&ring->pushes, 1, __ATOMIC_SEQ_CST);
+  parsimShmWake(&ring->pushes, INT_MAX);
+
+}
+
+static inline bool parsimShmClosed(ParsimShmQueue * queue) {
+  return __atomic_load_n(&queue->ring->closed, __ATOMIC_SEQ_CST) != 0;
+}
+
+/* Points a queue at the ring and cells of the mapping at header */
+static inline void parsimShmAttach(ParsimShmQueue * queue,
+                                   ParsimShmHeader * header,
+                                   ParsimShmRing * ring, uint64_t offset,
+                                   uint32_t capacity, uint32_t recordSize) {
+
+  queue->ring = ring;
+  queue->cells = (char *) header + offset;
+  queue->capacity = capacity;
+  queue->recordSize = recordSize;
+
+}
+
+/* Bytes from the start of the object to the end of the cells of a ring */
+static inline uint64_t parsimShmEnd(uint64_t offset, uint32_t capacity,
+                                    uint32_t recordSize) {
+  return offset + (uint64_t) capacity * (sizeof(uint64_t) + recordSize);
+}
+
+/*
+  Creates the object name with rings of messages and results cells, used by
+  parsim. Returns NULL when it can't
+*/
+static inline ParsimShm * parsimShmCreate(const char * name,
+                                          uint32_t messages,
+                                          uint32_t results) {
+
+  char path[PARSIM_SHM_NAME_SIZE];
+  parsimShmPath(name, path);
+
+  uint64_t messagesOffset = (sizeof(ParsimShmHeader) + 63) / 64 * 64;
+  uint64_t resultsOffset = parsimShmEnd(messagesOffset, messages,
+                                        sizeof(ParsimShmMessage));
+  resultsOffset = (resultsOffset + 63) / 64 * 64;
+  uint64_t size = parsimShmEnd(resultsOffset, results,
+                               sizeof(ParsimShmResult));
+
+  // A previous run may have left its object behind
+  shm_unlink(path);
+  int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) return NULL;
+
+  if (ftruncate(fd, size) < 0) {
+    close(fd);
+    shm_unlink(path);
+    return NULL;
+  }
+
+  void * memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    shm_unlink(path);
+    return NULL;
+  }
+
+  // ftruncate filled it with zeros
+  ParsimShmHeader * header = (ParsimShmHeader *) memory;
+  header->size = size;
+  header->messages.offset = messagesOffset;
+  header->messages.capacity = messages;
+  header->messages.recordSize = sizeof(ParsimShmMessage);
+  header->results.offset = resultsOffset;
+  header->results.capacity = results;
+  header->results.recordSize = sizeof(ParsimShmResult);
+
+  ParsimShm * shm = new ParsimShm;
+  shm->header = header;
+  shm->size = size;
+  parsimShmAttach(&shm->messages, header, &header->messages, messagesOffset,
+                  messages, sizeof(ParsimShmMessage));
+  parsimShmAttach(&shm->results, header, &header->results, resultsOffset,
+                  results, sizeof(ParsimShmResult));
+
+  for (uint32_t i = 0; i < messages; i++) {
+    *parsimShmCell(&shm->messages, i) = i;
+  }
+  for (uint32_t i = 0; i < results; i++) {
+    *parsimShmCell(&shm->results, i) = i;
+  }
+
+  header->version = PARSIM_SHM_VERSION;
+  // Clients only take the object once its magic is there
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(header->magic, PARSIM_SHM_MAGIC, sizeof(header->magic));
+
+  return shm;
+
+}
+
+/*
+  Maps the rings parsim created as name, NULL when they aren't there or
+  don't fit in the object
+*/
+static inline ParsimShm * parsimShmOpen(const char * name) {
+
+  char path[PARSIM_SHM_NAME_SIZE];
+  parsimShmPath(name, path);
+
+  int fd = shm_open(path, O_RDWR, 0);
+  if (fd < 0) return NULL;
+
+  struct stat status;
+  if (fstat(fd, &status) < 0 ||
+      status.st_size < (off_t) sizeof(ParsimShmHeader)) {
+    close(fd);
+    return NULL;
+  }
+
+  uint64_t size = status.st_size;
+  void * memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) return NULL;
+
+  ParsimShmHeader * header = (ParsimShmHeader *) memory;
+  bool ready = memcmp(header->magic, PARSIM_SHM_MAGIC,
+                      sizeof(header->magic)) == 0;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  uint64_t messagesOffset = header->messages.offset;
+  uint32_t messages = header->messages.capacity;
+  uint64_t resultsOffset = header->results.offset;
+  uint32_t results = header->results.capacity;
+
+  if (!ready || header->version != PARSIM_SHM_VERSION ||
+      header->size != size ||
+      header->messages.recordSize != sizeof(ParsimShmMessage) ||
+      header->results.recordSize != sizeof(ParsimShmResult) ||
+      messages < 2 || results < 2 ||
+      messagesOffset < sizeof(ParsimShmHeader) || messagesOffset > size ||
+      resultsOffset < sizeof(ParsimShmHeader) || resultsOffset > size ||
+      parsimShmEnd(messagesOffset, messages, sizeof(ParsimShmMessage)) >
+        size ||
+      parsimShmEnd(resultsOffset, results, sizeof(ParsimShmResult)) > size) {
+    munmap(memory, size);
+    return NULL;
+  }
+
+  ParsimShm * shm = new ParsimShm;
+  shm->header = header;
+  shm->size = size;
+  parsimShmAttach(&shm->messages, header, &header->messages, messagesOffset,
+                  messages, sizeof(ParsimShmMessage));
+  parsimShmAttach(&shm->results, header, &header->results, resultsOffset,
+                  results, sizeof(ParsimShmResult));
+
+  return shm;
+
+}
+
+static inline void parsimShmUnmap(ParsimShm * shm) {
+  munmap(shm->header, shm->size);
+  delete shm;
+}
+
+/* Waits for room and sends a message to parsim */
+static inline void parsimShmSend(ParsimShm * shm,
+                                 const ParsimShmMessage & message) {
+  parsimShmPush(&shm->messages, &message);
+}
+
+/* Sends a message to parsim, false when its ring is full */
+static inline bool parsimShmTrySend(ParsimShm * shm,
+                                    const ParsimShmMessage & message) {
+  return parsimShmTryPush(&shm->messages, &message);
+}
+
+/* Waits for a result, false once parsim wrote the last one */
+static inline bool parsimShmReceive(ParsimShm * shm,
+                                    ParsimShmResult & result) {
+  return parsimShmPop(&shm->results, &result);
+}
+
+/* Takes a result, false when none is ready */
+static inline bool parsimShmTryReceive(ParsimShm * shm,
+                                       ParsimShmResult & result) {
+  return parsimShmTryPop(&shm->results, &result);
+}
+
+/* No more messages: parsim finishes the ones it has and exits */
+static inline void parsimShmFinish(ParsimShm * shm) {
+  parsimShmClose(&shm->messages);
+}
+
+#endif